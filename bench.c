@@ -0,0 +1,252 @@
+/**
+ * @file bench.c
+ * @author Jack Wang
+ * @brief Microbenchmarks of kernel hot paths, built with CONFIG_BENCH (see 'make bench').
+ *        Each case is run many times, mcycle and minstret are read around every iteration,
+ *        and the results are printed over UART, one line per case:
+ *
+ *            BENCH name=<case> iters=<n> min=<cycles> med=<cycles> p99=<cycles> instret=<median>
+ *
+ *        Lock contention counters are printed after the last case (see lock_stats_print()),
+ *        then QEMU is stopped by the virt test finisher.
+ * @version 0.1
+ * @date 2023-05-14
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "os.h"
+
+#define BENCH_ITERS 1000
+#define FRAG_PAGES 2048
+
+/**
+ * @brief benchmark case
+ *
+ *  setup() and teardown() run once around all iterations and are not measured,
+ *  run() is one iteration. Iterations run with interrupts disabled, unless irq is
+ *  set for cases which depend on interrupts, e.g. the UART transmit ring.
+ */
+struct bench_case {
+    const char *name;
+    int iters;
+    void (*setup)(void);
+    void (*run)(void);
+    void (*teardown)(void);
+    int irq;
+};
+
+static uint32_t _cycles[BENCH_ITERS];
+static uint32_t _instret[BENCH_ITERS];
+
+/*
+ * page_alloc/page_free
+ */
+static void *_frag[FRAG_PAGES];
+
+// leave every other page of FRAG_PAGES free, so that the free lists are fragmented
+static void _frag_setup()
+{
+    for (int i = 0; i < FRAG_PAGES; i++)
+        _frag[i] = page_alloc(1);
+    for (int i = 0; i < FRAG_PAGES; i += 2) {
+        page_free(_frag[i]);
+        _frag[i] = NULL;
+    }
+}
+
+static void _frag_teardown()
+{
+    for (int i = 0; i < FRAG_PAGES; i++) {
+        if (_frag[i])
+            page_free(_frag[i]);
+        _frag[i] = NULL;
+    }
+    page_cache_drain();
+}
+
+static void _page_1()
+{
+    page_free(page_alloc(1));
+}
+
+static void _page_8()
+{
+    page_free(page_alloc(8));
+}
+
+static void _page_64()
+{
+    page_free(page_alloc(64));
+}
+
+/*
+ * zeroed single pages, taken from the zeroed pool vs zeroed inline. The idle task can't
+ * refill the pool while we are running, so fill it up front and keep iterations below its size
+ */
+#define ZEROED_ITERS 16
+
+static void _zero_fill()
+{
+    while (page_zero_refill())
+        ;
+}
+
+static void _page_1_zeroed()
+{
+    page_free(page_alloc_zeroed(1));
+}
+
+static void _page_1_zero_inline()
+{
+    void *p = page_alloc(1);
+    memzero_page(p);
+    page_free(p);
+}
+
+/*
+ * switch_to: the benchmark task and a partner yield to each other on the same hart,
+ * so an iteration is two voluntary switches. The partner yields with interrupts
+ * disabled too, otherwise its task_yield() turns them on inside the measurement
+ */
+static volatile int _partner_stop;
+static volatile int _partner_ready;
+
+static void _partner_task(void *param)
+{
+    reg_t flags = irq_save();
+    _partner_ready = 1;
+    while (!_partner_stop)
+        task_yield();
+    irq_restore(flags);
+}
+
+static void _switch_setup()
+{
+    _partner_stop = 0;
+    _partner_ready = 0;
+    task_create_affinity(_partner_task, NULL, PRIO_DEFAULT, 1U << r_tp());
+    while (!_partner_ready)
+        task_yield();
+}
+
+static void _switch_run()
+{
+    task_yield();
+}
+
+static void _switch_teardown()
+{
+    _partner_stop = 1;
+    task_yield();
+}
+
+/*
+ * console: printf and uart_puts only queue bytes to the transmit ring and leave them to
+ * THRE interrupts, so they run with interrupts enabled. uart_puts_polled is the same
+ * string sent synchronously, as uart_puts() does when called with interrupts disabled
+ */
+static void _printf()
+{
+    printf("bench printf %d 0x%x %s\n", 12345, 0xbeef, "abc");
+}
+
+static void _uart_puts()
+{
+    uart_puts("bench uart_puts\n");
+}
+
+static void _uart_puts_polled()
+{
+    static const char s[] = "bench uart_puts\n";
+    uart_write(s, sizeof(s) - 1);
+    uart_flush();
+}
+
+static void _snprintf()
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "bench snprintf %d 0x%x %s\n", 12345, 0xbeef, "abc");
+}
+
+static struct bench_case _cases[] = {
+    {"page_1", BENCH_ITERS, NULL, _page_1, NULL, 0},
+    {"page_8", BENCH_ITERS, NULL, _page_8, NULL, 0},
+    {"page_64", BENCH_ITERS, NULL, _page_64, NULL, 0},
+    {"page_1_frag", BENCH_ITERS, _frag_setup, _page_1, _frag_teardown, 0},
+    {"page_8_frag", BENCH_ITERS, _frag_setup, _page_8, _frag_teardown, 0},
+    {"page_64_frag", BENCH_ITERS, _frag_setup, _page_64, _frag_teardown, 0},
+    {"page_1_zeroed", ZEROED_ITERS, _zero_fill, _page_1_zeroed, page_zero_drain, 0},
+    {"page_1_zero_inline", ZEROED_ITERS, NULL, _page_1_zero_inline, NULL, 0},
+    {"switch_to", BENCH_ITERS, _switch_setup, _switch_run, _switch_teardown, 0},
+    {"snprintf", BENCH_ITERS, NULL, _snprintf, NULL, 0},
+    {"printf", 200, NULL, _printf, NULL, 1},
+    {"uart_puts", 200, NULL, _uart_puts, NULL, 1},
+    {"uart_puts_polled", 200, NULL, _uart_puts_polled, NULL, 0},
+};
+
+static void _sort(uint32_t *a, int n)
+{
+    for (int i = 1; i < n; i++) {
+        uint32_t x = a[i];
+        int j = i - 1;
+        while (j >= 0 && a[j] > x) {
+            a[j + 1] = a[j];
+            j--;
+        }
+        a[j + 1] = x;
+    }
+}
+
+static void _run_case(struct bench_case *c)
+{
+    if (c->setup)
+        c->setup();
+
+    // warm up caches and the page cache of the hart
+    c->run();
+    for (int i = 0; i < c->iters; i++) {
+        reg_t flags = 0;
+        if (c->irq)
+            // start with an empty ring, so that every iteration queues the same way
+            uart_flush();
+        else
+            // keep timer interrupts out of the measurement
+            flags = irq_save();
+        reg_t cycle = r_mcycle();
+        reg_t instret = r_minstret();
+        c->run();
+        _instret[i] = r_minstret() - instret;
+        _cycles[i] = r_mcycle() - cycle;
+        if (!c->irq)
+            irq_restore(flags);
+    }
+
+    if (c->teardown)
+        c->teardown();
+
+    _sort(_cycles, c->iters);
+    _sort(_instret, c->iters);
+    printf("BENCH name=%s iters=%d min=%u med=%u p99=%u instret=%u\n", c->name, c->iters,
+           _cycles[0], _cycles[c->iters / 2], _cycles[c->iters * 99 / 100], _instret[c->iters / 2]);
+}
+
+static void _bench_task(void *param)
+{
+    for (int i = 0; i < sizeof(_cases) / sizeof(_cases[0]); i++)
+        _run_case(&_cases[i]);
+    lock_stats_print();
+    printf("BENCH done\n");
+    uart_flush();
+
+    *(volatile uint32_t *)VIRT_TEST = VIRT_TEST_PASS;
+}
+
+/**
+ * @brief bench_start creates the benchmark task on current hart, called by hart 0
+ *        instead of os_main() when built with CONFIG_BENCH
+ */
+void bench_start()
+{
+    task_create_affinity(_bench_task, NULL, PRIO_DEFAULT, 1U << r_tp());
+}
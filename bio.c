@@ -0,0 +1,475 @@
+/**
+ * @file bio.c
+ * @author Jack Wang
+ * @brief Block buffer cache on top of the virtio block device.
+ *        Blocks are PAGE_SIZE bytes, each cached in a page from page_alloc(). A hash table
+ *        indexed by block number finds cached blocks, and an LRU list picks the clean block
+ *        unused for the longest time to evict. Writes are written back later by a flusher
+ *        task, and sequential reads make blocks ahead be read asynchronously. Contiguous
+ *        blocks are read or written by one request, one data buffer per block.
+ * @version 0.1
+ * @date 2023-05-23
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "os.h"
+
+#define BIO_NBUF 128            // cached blocks
+#define BIO_NHASH 64            // hash buckets, must be a power of 2
+#define BIO_WB_BATCH 64         // dirty blocks written back at a time
+#define BIO_WB_RETRIES 3        // failed write backs of a block before its data is dropped
+#define BIO_RA_TRIGGER 2        // sequential reads before reading ahead
+#define BIO_RA_WINDOW 16        // blocks read ahead of a sequential reader
+#define BIO_DIRTY_HIGH (BIO_NBUF / 2)  // dirty blocks to start writing back without the flusher
+#define BIO_FLUSH_MS 1000       // period of the flusher task
+
+#define SECTORS_PER_BLOCK (BLOCK_SIZE / SECTOR_SIZE)
+
+static buf_t _bufs[BIO_NBUF];
+static buf_t *_hash[BIO_NHASH];
+static buf_t _lru;              // list head, _lru.lru_next is the most recently used
+static uint32_t _nblocks;       // blocks of the device
+static int _ndirty;
+
+// sequential access detection
+static uint32_t _ra_expect;     // block a sequential reader reads next
+static int _ra_streak;          // sequential reads so far
+static uint32_t _ra_end;        // blocks before it have been read ahead
+
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t ra_blocks;         // blocks read ahead
+    uint32_t ra_hits;           // blocks read ahead and then read
+    uint32_t writes;            // blocks written back
+    uint32_t errors;
+    uint32_t dropped;           // blocks given up after BIO_WB_RETRIES failed writes
+} _stats;
+
+/*
+ * _lock protects all buffers and the lists, _wq holds tasks waiting for a buffer to be
+ * released or its I/O to complete
+ */
+static spinlock_t _lock;
+static wait_queue_t _wq = WAIT_QUEUE_INIT;
+
+static inline int _hashfn(uint32_t blockno)
+{
+    return blockno & (BIO_NHASH - 1);
+}
+
+static buf_t *_lookup(uint32_t blockno)
+{
+    buf_t *b = _hash[_hashfn(blockno)];
+    while (b && b->blockno != blockno)
+        b = b->hash_next;
+    return b;
+}
+
+static void _hash_insert(buf_t *b)
+{
+    int h = _hashfn(b->blockno);
+    b->hash_next = _hash[h];
+    _hash[h] = b;
+}
+
+static void _hash_remove(buf_t *b)
+{
+    buf_t **pp = &_hash[_hashfn(b->blockno)];
+    while (*pp != b)
+        pp = &(*pp)->hash_next;
+    *pp = b->hash_next;
+}
+
+// move b to the most recently used end of the LRU list
+static void _lru_touch(buf_t *b)
+{
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+    b->lru_next = _lru.lru_next;
+    b->lru_prev = &_lru;
+    _lru.lru_next->lru_prev = b;
+    _lru.lru_next = b;
+}
+
+/*
+ * take the least recently used buffer which is clean and unused, and rebind it to blockno,
+ * returns NULL if there is none. Must be called with _lock held.
+ */
+static buf_t *_evict(uint32_t blockno)
+{
+    for (buf_t *b = _lru.lru_prev; b != &_lru; b = b->lru_prev) {
+        if (b->refcnt == 0 && !(b->flags & (B_LOCKED | B_IO | B_DIRTY))) {
+            if (b->flags & B_HASHED)
+                _hash_remove(b);
+            b->blockno = blockno;
+            b->flags = B_HASHED;
+            b->errors = 0;
+            b->io_next = NULL;
+            _hash_insert(b);
+            _lru_touch(b);
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * completion of a request for a run of buffers, in interrupt context
+ */
+static void _io_done(blk_req_t *req)
+{
+    spin_lock(&_lock);
+    for (buf_t *b = req->priv; b; b = b->io_next) {
+        if (req->status < 0) {
+            _stats.errors++;
+            // keep the data of a failed write, it is retried by the next write backs
+            // until the device failed too many times, so that a dead disk can't hold
+            // the buffer dirty forever
+            if (req->write && ++b->errors < BIO_WB_RETRIES) {
+                b->flags |= B_DIRTY;
+                _ndirty++;
+            } else if (req->write) {
+                b->flags |= B_ERROR;
+                _stats.dropped++;
+            }
+        } else if (req->write) {
+            b->errors = 0;
+        } else {
+            b->flags |= B_VALID;
+        }
+        b->flags &= ~B_IO;
+    }
+    wait_wakeup(&_wq);
+    spin_unlock(&_lock);
+}
+
+/*
+ * group buffers marked B_IO into runs of contiguous blocks, chained by io_next.
+ * bufs must be sorted by block number. Returns the number of runs.
+ */
+static int _make_runs(buf_t **bufs, int n, buf_t **runs)
+{
+    int nruns = 0;
+    int len = 0;
+    buf_t *last = NULL;
+    for (int i = 0; i < n; i++) {
+        buf_t *b = bufs[i];
+        b->io_next = NULL;
+        if (last && last->blockno + 1 == b->blockno && len < BLK_MAX_SEGS) {
+            last->io_next = b;
+            len++;
+        } else {
+            runs[nruns++] = b;
+            len = 1;
+        }
+        last = b;
+    }
+    return nruns;
+}
+
+/*
+ * submit one request per run without waiting, must be called without _lock held
+ */
+static void _submit_runs(buf_t **runs, int nruns, int write)
+{
+    blk_req_t *reqs[BIO_WB_BATCH];
+    for (int i = 0; i < nruns; i++) {
+        blk_req_t *req = &runs[i]->req;
+        req->sector = runs[i]->blockno * SECTORS_PER_BLOCK;
+        req->write = write;
+        req->nseg = 0;
+        for (buf_t *b = runs[i]; b; b = b->io_next) {
+            req->seg[req->nseg].buf = b->data;
+            req->seg[req->nseg].len = BLOCK_SIZE;
+            req->nseg++;
+        }
+        req->done = _io_done;
+        req->priv = runs[i];
+        reqs[i] = req;
+    }
+    if (nruns > 0 && virtio_blk_submit(reqs, nruns) < 0)
+        panic("bio: invalid request");
+}
+
+/*
+ * start writing back up to BIO_WB_BATCH dirty buffers, and wait for them if wait is set.
+ * Returns the number of buffers written, and the number of them failed in *failed if
+ * wait is set and failed is not NULL.
+ */
+static int _writeback(int wait, int *failed)
+{
+    buf_t *bufs[BIO_WB_BATCH];
+    buf_t *runs[BIO_WB_BATCH];
+    int n = 0;
+
+    // collect dirty buffers in one pass, B_IO keeps them ours once _lock is released
+    reg_t flags = spin_lock_irqsave(&_lock);
+    for (int i = 0; i < BIO_NBUF && n < BIO_WB_BATCH; i++) {
+        buf_t *b = &_bufs[i];
+        if ((b->flags & (B_DIRTY | B_LOCKED | B_IO)) == B_DIRTY) {
+            b->flags = (b->flags & ~B_DIRTY) | B_IO;
+            _ndirty--;
+            bufs[n++] = b;
+        }
+    }
+    _stats.writes += n;
+    spin_unlock_irqrestore(&_lock, flags);
+
+    // sort them by block number without the lock, so that neighbours go in one request
+    for (int i = 1; i < n; i++) {
+        buf_t *b = bufs[i];
+        int j = i - 1;
+        while (j >= 0 && bufs[j]->blockno > b->blockno) {
+            bufs[j + 1] = bufs[j];
+            j--;
+        }
+        bufs[j + 1] = b;
+    }
+    int nruns = _make_runs(bufs, n, runs);
+    _submit_runs(runs, nruns, 1);
+
+    if (failed)
+        *failed = 0;
+    if (wait && n > 0) {
+        flags = spin_lock_irqsave(&_lock);
+        for (int i = 0; i < n; i++) {
+            while (bufs[i]->flags & B_IO)
+                wait_sleep(&_wq, &_lock);
+            if (failed && bufs[i]->errors)
+                (*failed)++;
+        }
+        spin_unlock_irqrestore(&_lock, flags);
+    }
+    return n;
+}
+
+/*
+ * track sequential reads, and bind buffers for blocks to read ahead of blockno.
+ * Returns the number of runs to submit. Must be called with _lock held.
+ */
+static int _readahead(uint32_t blockno, buf_t **runs)
+{
+    buf_t *bufs[BIO_RA_WINDOW];
+    int n = 0;
+
+    if (blockno == _ra_expect) {
+        _ra_streak++;
+    } else {
+        _ra_streak = 0;
+        _ra_end = 0;
+    }
+    _ra_expect = blockno + 1;
+    // keep half a window ahead of the reader, so that it does not catch up with the disk
+    if (_ra_streak < BIO_RA_TRIGGER || _ra_end > blockno + BIO_RA_WINDOW / 2)
+        return 0;
+
+    uint32_t start = _ra_end > blockno ? _ra_end : blockno + 1;
+    uint32_t end = blockno + 1 + BIO_RA_WINDOW;
+    if (end > _nblocks)
+        end = _nblocks;
+    for (uint32_t blk = start; blk < end; blk++) {
+        if (_lookup(blk))
+            continue;
+        buf_t *b = _evict(blk);
+        if (b == NULL)
+            break;
+        b->flags |= B_IO | B_RA;
+        bufs[n++] = b;
+    }
+    _ra_end = end;
+    _stats.ra_blocks += n;
+    return _make_runs(bufs, n, runs);
+}
+
+/*
+ * find or bind the buffer of blockno and lock it, sleeps while it is locked by others or
+ * in I/O, or while no buffer can be evicted. Must be called with _lock held.
+ */
+static buf_t *_get(uint32_t blockno, reg_t flags)
+{
+    while (1) {
+        buf_t *b = _lookup(blockno);
+        if (b) {
+            b->refcnt++;
+            while (b->flags & (B_LOCKED | B_IO))
+                wait_sleep(&_wq, &_lock);
+            b->flags |= B_LOCKED;
+            if (!(b->flags & B_VALID)) {
+                // read ahead failed
+                _stats.misses++;
+            } else {
+                _stats.hits++;
+                if (b->flags & B_RA)
+                    _stats.ra_hits++;
+            }
+            b->flags &= ~B_RA;
+            return b;
+        }
+
+        b = _evict(blockno);
+        if (b) {
+            b->refcnt = 1;
+            b->flags |= B_LOCKED;
+            _stats.misses++;
+            return b;
+        }
+
+        // every buffer is in use or dirty, clean some unless the dirty ones are in use too
+        if (_ndirty) {
+            spin_unlock_irqrestore(&_lock, flags);
+            int n = _writeback(1, NULL);
+            spin_lock_irqsave(&_lock);
+            if (n > 0)
+                continue;
+        }
+        wait_sleep(&_wq, &_lock);
+    }
+}
+
+/**
+ * @brief bio_read returns the locked buffer of a block with its data, reading it from disk
+ *        if it is not cached. Must be called by a task, and released by bio_release().
+ *
+ * @param blockno block number
+ * @return buf_t* the buffer, NULL if blockno is out of the disk or the read failed
+ */
+buf_t *bio_read(uint32_t blockno)
+{
+    buf_t *runs[BIO_RA_WINDOW];
+
+    if (blockno >= _nblocks)
+        return NULL;
+
+    reg_t flags = spin_lock_irqsave(&_lock);
+    buf_t *b = _get(blockno, flags);
+    int nruns = _readahead(blockno, runs);
+    spin_unlock_irqrestore(&_lock, flags);
+
+    _submit_runs(runs, nruns, 0);
+
+    if (b->flags & B_VALID)
+        return b;
+
+    // we hold the buffer, nobody else touches it until released
+    blk_req_t *req = &b->req;
+    req->sector = blockno * SECTORS_PER_BLOCK;
+    req->write = 0;
+    req->nseg = 1;
+    req->seg[0].buf = b->data;
+    req->seg[0].len = BLOCK_SIZE;
+    req->done = NULL;
+    if (virtio_blk_rw(&req, 1) < 0) {
+        __sync_fetch_and_add(&_stats.errors, 1);
+        bio_release(b);
+        return NULL;
+    }
+    b->flags |= B_VALID;
+    return b;
+}
+
+/**
+ * @brief bio_dirty marks a locked buffer modified, it is written back to disk later
+ *
+ * @param b buffer returned by bio_read()
+ */
+void bio_dirty(buf_t *b)
+{
+    reg_t flags = spin_lock_irqsave(&_lock);
+    if (!(b->flags & B_DIRTY)) {
+        b->flags |= B_DIRTY;
+        _ndirty++;
+    }
+    // new data, give it its own retries
+    b->flags &= ~B_ERROR;
+    b->errors = 0;
+    spin_unlock_irqrestore(&_lock, flags);
+}
+
+/**
+ * @brief bio_release unlocks a buffer returned by bio_read()
+ *
+ * @param b buffer to release
+ */
+void bio_release(buf_t *b)
+{
+    reg_t flags = spin_lock_irqsave(&_lock);
+    b->flags &= ~B_LOCKED;
+    b->refcnt--;
+    _lru_touch(b);
+    wait_wakeup(&_wq);
+    int flush = _ndirty > BIO_DIRTY_HIGH;
+    spin_unlock_irqrestore(&_lock, flags);
+
+    // do not wait for the flusher when too many buffers are dirty
+    if (flush)
+        _writeback(0, NULL);
+}
+
+/**
+ * @brief bio_sync writes back all dirty buffers and waits for them. It gives up once a
+ *        pass writes nothing successfully, failed buffers are retried by later syncs.
+ *
+ * @return int 0 if success, -1 if any write failed
+ */
+int bio_sync()
+{
+    int ret = 0;
+    while (1) {
+        int failed;
+        int n = _writeback(1, &failed);
+        if (failed)
+            ret = -1;
+        if (n == 0 || failed == n)
+            return ret;
+    }
+}
+
+/**
+ * @brief bio_stats_print prints counters of the buffer cache
+ */
+void bio_stats_print()
+{
+    printf("bio: hits %u, misses %u, read ahead %u (%u hit), written %u, errors %u, dropped %u\n",
+           _stats.hits, _stats.misses, _stats.ra_blocks, _stats.ra_hits, _stats.writes, _stats.errors,
+           _stats.dropped);
+}
+
+static void _flusher_task(void *param)
+{
+    while (1) {
+        task_sleep_ms(BIO_FLUSH_MS);
+        bio_sync();
+    }
+}
+
+/**
+ * @brief bio_init allocates buffers and starts the flusher task, called once by hart 0
+ *        after the virtio block device and the scheduler are initialized
+ */
+void bio_init()
+{
+    spin_init(&_lock, "bio");
+    _lru.lru_next = _lru.lru_prev = &_lru;
+    _nblocks = virtio_blk_capacity() / SECTORS_PER_BLOCK;
+    if (_nblocks == 0)
+        return;
+
+    for (int i = 0; i < BIO_NBUF; i++) {
+        buf_t *b = &_bufs[i];
+        b->data = page_alloc(1);
+        if (b->data == NULL)
+            panic("bio_init: out of memory");
+        b->flags = 0;
+        b->refcnt = 0;
+        b->errors = 0;
+        b->lru_next = _lru.lru_next;
+        b->lru_prev = &_lru;
+        _lru.lru_next->lru_prev = b;
+        _lru.lru_next = b;
+    }
+    if (task_create(_flusher_task, NULL, PRIO_DEFAULT) < 0)
+        panic("bio_init: failed to create flusher task");
+    printf("bio: %d buffers, %u blocks\n", BIO_NBUF, _nblocks);
+}
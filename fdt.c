@@ -0,0 +1,181 @@
+/**
+ * @file fdt.c
+ * @author Jack Wang
+ * @brief Reads the flattened device tree (FDT) passed by QEMU in a1 at boot, to find out how
+ *        much RAM we really have. HEAP_SIZE defaults to the RAM size in os.ld, fdt_init()
+ *        resizes it to the end of the memory bank holding the kernel, so that the heap uses
+ *        all guest RAM given by 'make run MEM=...' without relinking.
+ *        QEMU puts the FDT near the end of RAM, the heap stops below it so that the FDT stays
+ *        readable later.
+ * @version 0.1
+ * @date 2023-05-28
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "os.h"
+
+extern uintptr_t HEAP_START;
+extern uint32_t HEAP_SIZE;
+
+#define FDT_MAGIC       0xd00dfeed
+
+// offsets of header fields, all big-endian 32 bits
+#define FDT_TOTALSIZE   4
+#define FDT_OFF_STRUCT  8
+#define FDT_OFF_STRINGS 12
+
+// tokens of the structure block
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+/*
+ * RAM must end below the last megapage, so that end addresses never wrap to 0
+ * with 32-bit pointers, e.g. 'make run MEM=2G' leaves the top 4 MB unused.
+ */
+#define FDT_MEM_LIMIT   0xffc00000U
+
+static uint32_t _be32(const void *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+static int _streq(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static uint32_t _align4(uint32_t n)
+{
+    return (n + 3) & ~3U;
+}
+
+/*
+ * memory nodes are named "memory" or "memory@<address>"
+ */
+static int _is_memory(const char *name)
+{
+    const char *s = "memory";
+    while (*s && *s == *name) {
+        s++;
+        name++;
+    }
+    return *s == 0 && (*name == 0 || *name == '@');
+}
+
+/*
+ * read a value of n cells, fail if it does not fit in 32 bits
+ */
+static int _read_cells(const uint8_t *p, uint32_t n, uint32_t *value)
+{
+    if (n == 0 || n > 2)
+        return -1;
+    if (n == 2 && _be32(p) != 0)
+        return -1;
+    *value = _be32(p + 4 * (n - 1));
+    return 0;
+}
+
+/**
+ * @brief _find_memory finds the first bank in the reg property of the first memory node
+ *
+ * @param fdt the FDT
+ * @param base base address of the bank
+ * @param size size of the bank
+ * @return int 0 if found, -1 otherwise
+ */
+static int _find_memory(const uint8_t *fdt, uint32_t *base, uint32_t *size)
+{
+    const uint8_t *p = fdt + _be32(fdt + FDT_OFF_STRUCT);
+    const uint8_t *end = fdt + _be32(fdt + FDT_TOTALSIZE);
+    const char *strings = (const char *)fdt + _be32(fdt + FDT_OFF_STRINGS);
+    // defaults given by the devicetree specification, the root node usually overrides them
+    uint32_t acells = 2, scells = 1;
+    int depth = 0, in_memory = 0;
+
+    while (p + 4 <= end) {
+        uint32_t token = _be32(p);
+        p += 4;
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+            uint32_t len = 0;
+            while (p + len < end && name[len])
+                len++;
+            depth++;
+            // memory nodes are children of the root node
+            in_memory = depth == 2 && _is_memory(name);
+            p += _align4(len + 1);
+            break;
+        }
+        case FDT_END_NODE:
+            depth--;
+            in_memory = 0;
+            break;
+        case FDT_PROP: {
+            uint32_t len = _be32(p);
+            const char *name = strings + _be32(p + 4);
+            const uint8_t *value = p + 8;
+            p += 8 + _align4(len);
+            if (depth == 1 && len == 4 && _streq(name, "#address-cells"))
+                acells = _be32(value);
+            else if (depth == 1 && len == 4 && _streq(name, "#size-cells"))
+                scells = _be32(value);
+            else if (in_memory && _streq(name, "reg") && len >= 4 * (acells + scells))
+                return _read_cells(value, acells, base) || _read_cells(value + 4 * acells, scells, size)
+                    ? -1 : 0;
+            break;
+        }
+        case FDT_NOP:
+            break;
+        default:
+            // FDT_END or garbage
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief fdt_init sizes the heap from the memory node of the FDT. Must be called by hart 0
+ *        before page_init(). Keeps the size given by os.ld if there is no usable FDT.
+ *
+ * @param fdt the FDT, passed by QEMU in a1
+ */
+void fdt_init(void *fdt)
+{
+    uint32_t base, size;
+
+    if (fdt == NULL || ((uintptr_t)fdt & 3) || _be32(fdt) != FDT_MAGIC) {
+        printf("fdt: no device tree at %p, heap size from os.ld\n", fdt);
+        return;
+    }
+    if (_find_memory(fdt, &base, &size) < 0 || base >= FDT_MEM_LIMIT) {
+        printf("fdt: no usable memory node, heap size from os.ld\n");
+        return;
+    }
+    if (size > FDT_MEM_LIMIT - base)
+        size = FDT_MEM_LIMIT - base;
+
+    uintptr_t end = base + size;
+    if (HEAP_START < base || HEAP_START >= end) {
+        printf("fdt: kernel is not in memory %p -> %p, heap size from os.ld\n",
+               (void *)base, (void *)end);
+        return;
+    }
+    // keep the FDT out of the heap
+    uintptr_t blob = (uintptr_t)fdt;
+    if (blob >= HEAP_START && blob < end)
+        end = blob & ~(uintptr_t)(PAGE_SIZE - 1);
+
+    HEAP_SIZE = end - HEAP_START;
+    printf("fdt: memory %p -> %p, device tree at %p\n", (void *)base, (void *)(base + size), fdt);
+}
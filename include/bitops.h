@@ -0,0 +1,45 @@
+#ifndef __BITOPS_H__
+#define __BITOPS_H__
+
+#include "types.h"
+
+/*
+ * rv32ima has no count leading/trailing zero instructions (they come with the
+ * Zbb extension), and we do not link libgcc, so __builtin_ctz() and friends are
+ * not available. Following helpers do the job with a multiply and a table lookup.
+ */
+
+/**
+ * @brief ctz32 counts trailing zeros of x
+ * 
+ * @param x value, must not be zero
+ * @return int index of the lowest set bit
+ */
+static inline int ctz32(uint32_t x)
+{
+    // de Bruijn sequence B(2, 5), see "Using de Bruijn Sequences to Index a 1 in a Computer Word"
+    static const uint8_t table[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+    };
+    return table[((x & -x) * 0x077CB531U) >> 27];
+}
+
+/**
+ * @brief clz32 counts leading zeros of x
+ * 
+ * @param x value, must not be zero
+ * @return int 31 - index of the highest set bit
+ */
+static inline int clz32(uint32_t x)
+{
+    int n = 0;
+    if ((x & 0xFFFF0000U) == 0) { n += 16; x <<= 16; }
+    if ((x & 0xFF000000U) == 0) { n += 8; x <<= 8; }
+    if ((x & 0xF0000000U) == 0) { n += 4; x <<= 4; }
+    if ((x & 0xC0000000U) == 0) { n += 2; x <<= 2; }
+    if ((x & 0x80000000U) == 0) { n += 1; }
+    return n;
+}
+
+#endif
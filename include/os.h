@@ -3,21 +3,155 @@
 
 #include "types.h"
 #include "platform.h"
+#include "riscv.h"
+#include "bitops.h"
 
 #include <stddef.h>
 #include <stdarg.h>
 
+// lock.c
+/**
+ * @brief contention counters of a lock
+ *  - acquires: times the lock is acquired
+ *  - contended: times the lock is found held and we have to wait
+ *  - spins: total iterations spent waiting
+ */
+typedef struct lock_stat {
+    const char *name;
+    uint32_t acquires;
+    uint32_t contended;
+    uint32_t spins;
+    struct lock_stat *next;     // in the list of all locks, see lock_stats_print()
+} lock_stat_t;
+
+typedef struct spinlock {
+    volatile uint32_t locked;
+    int hart;                   // hart holding the lock, -1 if none
+    lock_stat_t stat;
+} spinlock_t;
+
+typedef struct ticketlock {
+    volatile uint32_t next;     // next ticket to give out
+    volatile uint32_t owner;    // ticket being served
+    int hart;                   // hart holding the lock, -1 if none
+    lock_stat_t stat;
+} ticketlock_t;
+
+extern void spin_init(spinlock_t *lock, const char *name);
+extern void spin_lock(spinlock_t *lock);
+extern int spin_trylock(spinlock_t *lock);
+extern void spin_unlock(spinlock_t *lock);
+extern reg_t spin_lock_irqsave(spinlock_t *lock);
+extern void spin_unlock_irqrestore(spinlock_t *lock, reg_t flags);
+extern int spin_holding(spinlock_t *lock);
+extern void ticket_init(ticketlock_t *lock, const char *name);
+extern void ticket_lock(ticketlock_t *lock);
+extern void ticket_unlock(ticketlock_t *lock);
+extern reg_t ticket_lock_irqsave(ticketlock_t *lock);
+extern void ticket_unlock_irqrestore(ticketlock_t *lock, reg_t flags);
+extern int ticket_holding(ticketlock_t *lock);
+extern void lock_stats_print(void);
+
 // uart.c
 extern int uart_putc(char ch);
 extern void uart_puts(char *s);
+extern void uart_write(const char *s, int n);
+extern void uart_flush(void);
+extern void uart_isr(void);
+extern int uart_getc(void);
+extern int uart_read(char *buf, int n);
+extern int uart_readline(char *buf, int n);
+
+// plic.c
+extern void plic_set_priority(int irq, int priority);
+extern void plic_set_threshold(int hart, int threshold);
+extern void plic_enable(int hart, int irq);
+extern void plic_disable(int hart, int irq);
+extern int plic_register(int irq, void (*handler)(void), int hart);
+extern int plic_claim(void);
+extern void plic_complete(int irq);
+extern int plic_dispatch(int irq);
 
 // printf.c
+/**
+ * @brief sink of formatted output
+ *  - buf/size: buffer to stage the output
+ *  - pos: number of chars staged in buf
+ *  - total: number of chars formatted so far
+ *  - flush: sends out the chars staged in buf, NULL means chars that don't fit are dropped
+ *  - priv: private data of flush
+ */
+typedef struct sink {
+    char *buf;
+    size_t size;
+    size_t pos;
+    size_t total;
+    void (*flush)(struct sink *sink);
+    void *priv;
+} sink_t;
+
 extern int printf(const char *s, ...);
+extern int snprintf(char *out, size_t n, const char *s, ...);
+extern int vsnprintf(char *out, size_t n, const char *s, va_list vl);
+extern int sink_printf(sink_t *sink, const char *s, ...);
+extern int vsink_printf(sink_t *sink, const char *s, va_list vl);
 extern void panic(char *s);
 
+// string.S
+extern void *memset(void *dst, int c, size_t n);
+extern void *memcpy(void *dst, const void *src, size_t n);
+extern void *memmove(void *dst, const void *src, size_t n);
+extern void memzero_page(void *page);
+
 // page.c
+#define PAGE_SIZE 4096
+#define PAGE_ORDER 12
+
 extern void *page_alloc(int pages);
 extern void page_free(void *p);
+extern int page_cache_tune(int low, int high, int batch);
+extern void page_cache_drain(void);
+extern void *page_alloc_zeroed(int npages);
+extern int page_zero_refill(void);
+extern void page_zero_drain(void);
+
+// slab.c
+#define CACHE_LINE_SIZE 64
+
+typedef struct kmem_cache kmem_cache_t;
+
+extern kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+extern void *kmem_cache_alloc(kmem_cache_t *cache);
+extern void kmem_cache_free(kmem_cache_t *cache, void *obj);
+extern void *kmalloc(size_t size);
+extern void kfree(void *p);
+
+// kernel.c
+extern void smp_release(void);
+
+// timer.c
+struct timer_node {
+    struct timer_node *next;
+    struct timer_node *prev;
+};
+
+/**
+ * @brief timer, see timer_setup() and timer_start()
+ */
+typedef struct timer {
+    struct timer_node node;     // in a slot of the timer wheel, must be the first member
+    uint64_t expires;           // in mtime ticks
+    uint64_t period;            // in mtime ticks, 0 for a one-shot timer
+    void (*func)(void *arg);
+    void *arg;
+    volatile int hart;          // hart whose wheel holds the timer, -1 if not pending
+} timer_t;
+
+extern uint64_t timer_now(void);
+extern void timer_setup(timer_t *t, void (*func)(void *arg), void *arg);
+extern void timer_start(timer_t *t, uint32_t us, uint32_t period_us);
+extern int timer_cancel(timer_t *t);
+extern void timer_set_quantum(uint32_t us);
 
 
 /**
@@ -155,9 +289,146 @@ typedef struct __context_t {
         reg_t _x31;
         reg_t t6;
     };
+    // pc to resume the task, saved from mepc when trapped
+    reg_t pc;
+    // kind of frame saved in this context, see below
+    reg_t frame;
+    // non-zero while a hart is still running on this context, cleared by switch_to()
+    reg_t busy;
 } context_t;
 
-extern int task_create(void (*task)(void));
-extern void task_delay(volatile int count);
+/*
+ * kinds of frame saved in context_t
+ *  - FRAME_TRAP: all registers and pc are saved by trap_vector, and restored by mret
+ *  - FRAME_VOLUNTARY: only ra, sp and s0-s11 are saved by switch_context(), and restored
+ *    by ret, because caller-saved registers are already dead when a task calls into the
+ *    scheduler. gp never changes, and tp holds the id of the hart, so they are not saved.
+ */
+#define FRAME_TRAP 0
+#define FRAME_VOLUNTARY 1
+
+// sched.c
+/*
+ * priority of task, 0 is the highest. The idle task of each hart runs
+ * only when there is no task of any priority ready.
+ */
+#define PRIO_LEVELS 32
+#define PRIO_DEFAULT 16
+
+/*
+ * affinity of task, bit i is set if the task may run on hart i
+ */
+#define HART_MASK_ALL ((1U << MAXNUM_CPU) - 1)
+
+extern int task_create(void (*start_routine)(void *param), void *param, uint8_t priority);
+extern int task_create_affinity(void (*start_routine)(void *param), void *param, uint8_t priority, uint32_t affinity);
+extern int task_set_affinity(uint32_t affinity);
+extern void task_yield(void);
+extern void task_exit(void);
+extern void task_sleep_us(uint32_t us);
+extern void task_sleep_ms(uint32_t ms);
+
+/**
+ * @brief wait queue of blocked tasks, protected by a lock of its user, see wait_sleep()
+ */
+typedef struct wait_queue {
+    struct task *head;
+    struct task *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT {NULL, NULL}
+
+extern void wait_sleep(wait_queue_t *wq, spinlock_t *lock);
+extern void wait_wakeup(wait_queue_t *wq);
+
+// virtio.c
+#define SECTOR_SIZE 512
+#define BLK_MAX_SEGS 8          // max data buffers of a request
+#define BLK_PENDING 1           // status of a request in flight
+
+/**
+ * @brief block device request, see virtio_blk_submit()
+ */
+typedef struct blk_req {
+    uint32_t sector;            // first sector to read or write
+    int write;                  // 1 to write, 0 to read
+    int nseg;                   // number of data buffers, scatter-gather
+    struct {
+        void *buf;
+        uint32_t len;           // multiple of SECTOR_SIZE
+    } seg[BLK_MAX_SEGS];
+    void (*done)(struct blk_req *req);  // called in interrupt context on completion, may be NULL
+    void *priv;                 // for the owner of the request
+    volatile int status;        // BLK_PENDING in flight, then 0 if succeeded or -1 if failed
+    struct blk_req *next;       // used by the driver
+} blk_req_t;
+
+extern uint32_t virtio_blk_capacity(void);
+extern int virtio_blk_submit(blk_req_t **reqs, int n);
+extern int virtio_blk_wait(blk_req_t *req);
+extern int virtio_blk_rw(blk_req_t **reqs, int n);
+
+// bio.c
+#define BLOCK_SIZE PAGE_SIZE
+
+/*
+ * flags of buffer
+ */
+#define B_VALID  (1 << 0)       // data has been read from disk
+#define B_DIRTY  (1 << 1)       // data has been modified, needs to be written back
+#define B_LOCKED (1 << 2)       // held by a task, see bio_read()
+#define B_IO     (1 << 3)       // read ahead or write back in flight
+#define B_RA     (1 << 4)       // read ahead, not read yet
+#define B_HASHED (1 << 5)       // bound to blockno
+#define B_ERROR  (1 << 6)       // write back failed BIO_WB_RETRIES times, data not on disk
+
+/**
+ * @brief buffer of a cached block, see bio_read()
+ */
+typedef struct buf {
+    uint32_t blockno;
+    volatile int flags;
+    int refcnt;                 // tasks holding or waiting for the buffer
+    int errors;                 // failed write backs in a row
+    uint8_t *data;              // BLOCK_SIZE bytes, a page
+    struct buf *hash_next;
+    struct buf *lru_prev;
+    struct buf *lru_next;
+    struct buf *io_next;        // next buffer in the same request
+    blk_req_t req;              // request of the run this buffer starts
+} buf_t;
+
+extern buf_t *bio_read(uint32_t blockno);
+extern void bio_dirty(buf_t *b);
+extern void bio_release(buf_t *b);
+extern int bio_sync(void);
+extern void bio_stats_print(void);
+
+// trace.c
+/*
+ * trace events, names are listed in trace.c and dumped with the records
+ */
+enum trace_event {
+    TRACE_SWITCH = 1,           // prev task id (-1 if none), next task id, 1 if next is idle
+    TRACE_TRAP,                 // mcause, mepc
+    TRACE_WAKEUP,               // task id, hart the task is queued on
+    TRACE_STEAL,                // victim hart, task id
+    TRACE_PAGE_ALLOC,           // pages, address (0 if failed)
+    TRACE_PAGE_FREE,            // address
+    TRACE_MARK,                 // free for ad hoc instrumentation
+    TRACE_NR
+};
+
+extern void trace_emit(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2);
+extern void trace_dump(void);
+
+/*
+ * trace points cost nothing unless built with CONFIG_TRACE (see 'make TRACE=1')
+ */
+#ifdef CONFIG_TRACE
+#define TRACE(event, a0, a1, a2) trace_emit(event, (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+#else
+#define TRACE(event, a0, a1, a2) do { } while (0)
+#endif
 
 #endif
\ No newline at end of file
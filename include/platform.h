@@ -19,6 +19,7 @@
  * see https://github.com/qemu/qemu/blob/master/hw/riscv/virt.c, virt_memmap[] for more detailed infomation.
  * 
  * 0x00001000 -- boot ROM, provided by qemu
+ * 0x00100000 -- test finisher
  * 0x02000000 -- CLINT
  * 0x0C000000 -- PLIC
  * 0x10000000 -- UART0
@@ -26,9 +27,72 @@
  * 0x80000000 -- boot ROM jumps here in machine mode, where we load our kernel
  */
 
+/**
+ * @brief test finisher (sifive_test) of QEMU virt machine, writing to it exits QEMU
+ * see https://github.com/qemu/qemu/blob/master/include/hw/misc/sifive_test.h
+ */
+#define VIRT_TEST 0x100000L
+#define VIRT_TEST_PASS 0x5555
+#define VIRT_TEST_FAIL 0x3333
+
 /**
  * @brief UART resigter mapped address
  */
 #define UART0 0x10000000L
 
+/*
+ * UART0 interrupt source of PLIC
+ * see https://github.com/qemu/qemu/blob/master/include/hw/riscv/virt.h, enum { UART0_IRQ = 10, ...}
+ */
+#define UART0_IRQ 10
+
+/*
+ * VirtIO MMIO block device, and its interrupt source of PLIC
+ * see https://github.com/qemu/qemu/blob/master/include/hw/riscv/virt.h, enum { VIRTIO_IRQ = 1, ...}
+ */
+#define VIRTIO0 0x10001000L
+#define VIRTIO0_IRQ 1
+
+/**
+ * @brief PLIC (Platform Level Interrupt Controller) resigter mapped address
+ * see https://github.com/qemu/qemu/blob/master/include/hw/riscv/virt.h
+ * 
+ * Each hart of QEMU virt machine has two PLIC contexts, context 2 * hart is for
+ * machine mode and context 2 * hart + 1 is for supervisor mode, we only use the
+ * machine mode ones.
+ *  - PRIORITY: priority of each interrupt source, 0 means never interrupt
+ *  - PENDING: pending bits of interrupt sources, 32 sources per word
+ *  - MENABLE: enable bits of interrupt sources for hart, 32 sources per word
+ *  - MTHRESHOLD: interrupts with priority <= threshold are masked
+ *  - MCLAIM: reading returns the highest priority pending interrupt and claims it
+ *  - MCOMPLETE: writing the interrupt claimed tells PLIC it has been handled
+ */
+#define PLIC 0x0c000000L
+#define PLIC_NR_IRQS 96         // interrupt sources, see VIRT_IRQCHIP_NUM_SOURCES
+#define PLIC_PRIORITY(id) (PLIC + (id) * 4)
+#define PLIC_PENDING(id) (PLIC + 0x1000 + ((id) / 32) * 4)
+#define PLIC_MENABLE(hart) (PLIC + 0x2000 + (hart) * 0x100)
+#define PLIC_MTHRESHOLD(hart) (PLIC + 0x200000 + (hart) * 0x2000)
+#define PLIC_MCLAIM(hart) (PLIC + 0x200004 + (hart) * 0x2000)
+#define PLIC_MCOMPLETE(hart) (PLIC + 0x200004 + (hart) * 0x2000)
+
+/**
+ * @brief CLINT (Core Local Interruptor) resigter mapped address
+ * see https://github.com/qemu/qemu/blob/master/include/hw/intc/riscv_aclint.h
+ * 
+ *  - MSIP: one 32 bits register per hart, writing 1 raises a machine software interrupt to that hart
+ *  - MTIMECMP: one 64 bits register per hart, a timer interrupt is pending when mtime >= mtimecmp
+ *  - MTIME: 64 bits real time counter, increased at CLINT_TIMEBASE_FREQ
+ */
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4 * (hartid))
+#define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8 * (hartid))
+#define CLINT_MTIME (CLINT + 0xBFF8)
+
+/*
+ * mtime of QEMU virt machine increases at 10 MHz
+ * see https://github.com/qemu/qemu/blob/master/include/hw/intc/riscv_aclint.h, RISCV_ACLINT_DEFAULT_TIMEBASE_FREQ
+ */
+#define CLINT_TIMEBASE_FREQ 10000000
+
 #endif
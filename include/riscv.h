@@ -0,0 +1,227 @@
+#ifndef __RISCV_H__
+#define __RISCV_H__
+
+#include "types.h"
+
+#ifdef HOST_BUILD
+/*
+ * host build of portable modules (see tools/host): there are no CSRs on the host,
+ * the driver plays the harts by setting host_hartid, and interrupts do not exist
+ */
+extern int host_hartid;
+
+static inline reg_t r_tp()
+{
+    return host_hartid;
+}
+
+static inline reg_t irq_save()
+{
+    return 0;
+}
+
+static inline void irq_restore(reg_t x)
+{
+}
+#else
+
+/*
+ * ref: https://github.com/mit-pdos/xv6-riscv/blob/riscv/kernel/riscv.h
+ */
+
+/**
+ * @brief r_tp reads tp register, which holds the hart id (set in start.S)
+ * 
+ * @return reg_t hart id of current hart
+ */
+static inline reg_t r_tp()
+{
+    reg_t x;
+    asm volatile("mv %0, tp" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief r_mhartid reads mhartid register, which returns the id of current hart
+ * 
+ * @return reg_t hart id of current hart
+ */
+static inline reg_t r_mhartid()
+{
+    reg_t x;
+    asm volatile("csrr %0, mhartid" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief w_mscratch write mscratch register to x
+ * 
+ * @param x value set to mscratch register
+ */
+static inline void w_mscratch(reg_t x)
+{
+    asm volatile("csrw mscratch, %0" : : "r" (x));
+}
+
+/* Machine Status Register, mstatus */
+#define MSTATUS_MPP (3 << 11)
+#define MSTATUS_MPP_M (3 << 11)
+#define MSTATUS_MPIE (1 << 7)
+#define MSTATUS_MIE (1 << 3)
+
+/**
+ * @brief r_mstatus reads mstatus register
+ * 
+ * @return reg_t value of mstatus
+ */
+static inline reg_t r_mstatus()
+{
+    reg_t x;
+    asm volatile("csrr %0, mstatus" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief w_mstatus writes x to mstatus register
+ * 
+ * @param x value set to mstatus
+ */
+static inline void w_mstatus(reg_t x)
+{
+    asm volatile("csrw mstatus, %0" : : "r" (x));
+}
+
+/**
+ * @brief irq_save disables interrupts of current hart
+ * 
+ * @return reg_t previous interrupt state, passed to irq_restore()
+ */
+static inline reg_t irq_save()
+{
+    reg_t x;
+    asm volatile("csrrci %0, mstatus, %1" : "=r" (x) : "i" (MSTATUS_MIE));
+    return x & MSTATUS_MIE;
+}
+
+/**
+ * @brief irq_restore restores interrupts state of current hart saved by irq_save()
+ * 
+ * @param x previous interrupt state
+ */
+static inline void irq_restore(reg_t x)
+{
+    if (x)
+        asm volatile("csrsi mstatus, %0" : : "i" (MSTATUS_MIE));
+}
+
+/**
+ * @brief w_mepc writes x to mepc register, which holds the pc to return to after mret
+ * 
+ * @param x value set to mepc
+ */
+static inline void w_mepc(reg_t x)
+{
+    asm volatile("csrw mepc, %0" : : "r" (x));
+}
+
+/**
+ * @brief r_mepc reads mepc register
+ * 
+ * @return reg_t value of mepc
+ */
+static inline reg_t r_mepc()
+{
+    reg_t x;
+    asm volatile("csrr %0, mepc" : "=r" (x));
+    return x;
+}
+
+/**
+ * @brief w_mtvec writes x to mtvec register, which holds the address of trap vector
+ * 
+ * @param x value set to mtvec
+ */
+static inline void w_mtvec(reg_t x)
+{
+    asm volatile("csrw mtvec, %0" : : "r" (x));
+}
+
+/**
+ * @brief r_mcause reads mcause register
+ * 
+ * @return reg_t value of mcause
+ */
+static inline reg_t r_mcause()
+{
+    reg_t x;
+    asm volatile("csrr %0, mcause" : "=r" (x) );
+    return x;
+}
+
+/* Machine-mode Interrupt Enable, mie */
+#define MIE_MEIE (1 << 11) // external
+#define MIE_MTIE (1 << 7)  // timer
+#define MIE_MSIE (1 << 3)  // software
+
+/**
+ * @brief r_mie reads mie register
+ * 
+ * @return reg_t value of mie
+ */
+static inline reg_t r_mie()
+{
+    reg_t x;
+    asm volatile("csrr %0, mie" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief w_mie writes x to mie register
+ * 
+ * @param x value set to mie
+ */
+static inline void w_mie(reg_t x)
+{
+    asm volatile("csrw mie, %0" : : "r" (x));
+}
+
+/**
+ * @brief r_mcycle reads low 32 bits of mcycle, the number of cycles executed by current hart
+ * 
+ * @return reg_t value of mcycle
+ */
+static inline reg_t r_mcycle()
+{
+    reg_t x;
+    asm volatile("csrr %0, mcycle" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief r_minstret reads low 32 bits of minstret, the number of instructions retired by current hart
+ * 
+ * @return reg_t value of minstret
+ */
+static inline reg_t r_minstret()
+{
+    reg_t x;
+    asm volatile("csrr %0, minstret" : "=r" (x) );
+    return x;
+}
+
+/**
+ * @brief wfi stalls current hart until an interrupt enabled in mie is pending, even if
+ *        mstatus.MIE is 0, so that it can be used without losing a wakeup
+ */
+static inline void wfi()
+{
+    asm volatile("wfi");
+}
+
+/* Machine Cause Register, mcause */
+#define MCAUSE_MASK_INTERRUPT (reg_t)0x80000000
+#define MCAUSE_MASK_ECODE     (reg_t)0x7FFFFFFF
+
+#endif // HOST_BUILD
+
+#endif
@@ -1,12 +1,22 @@
 #ifndef __TYPES_H__
 #define __TYPES_H__
 
+#ifdef HOST_BUILD
+// host build of portable modules (see tools/host), take fixed width types from the host
+#include <stdint.h>
+
+typedef uintptr_t reg_t;
+#else
 typedef unsigned char       uint8_t;
 typedef unsigned short      uint16_t;
 typedef unsigned int        uint32_t;
 typedef unsigned long long  uint64_t;
 
+// pointer is 32 bits for RISCV32
+typedef uint32_t uintptr_t;
+
 // register is 32 bits for RISCV32
 typedef uint32_t reg_t;
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,22 +1,141 @@
 #include "os.h"
 
 extern void uart_init(void);
+extern void printf_init(void);
+extern void plic_init(void);
+extern void fdt_init(void *fdt);
 extern void page_init(void);
+extern void slab_init(void);
+extern void virtio_blk_init(void);
+extern void bio_init(void);
+extern void trap_init(void);
+extern void timer_init(void);
 extern void sched_init(void);
+extern void sched_init_hart(void);
 extern void schedule(void);
+extern void os_main(void);
+extern void bench_start(void);
+extern void trace_start(void);
 
-void start_kernel(void){
+/*
+ * boot_cycles holds mcycle of hart 0 at each stage of the boot, the first two are
+ * written by start.S, so keep the order of BOOT_START and BOOT_BSS.
+ */
+enum {
+    BOOT_START,     // entry of _start
+    BOOT_BSS,       // .bss cleared
+    BOOT_KERNEL,    // entry of start_kernel
+    BOOT_INIT,      // global initialization done, secondary harts released
+    BOOT_TASK,      // first task running
+    BOOT_NR,
+};
+uint32_t boot_cycles[BOOT_NR];
+
+/*
+ * smp_released is polled by secondary harts parking in start.S,
+ * they will enter start_secondary() once it is set.
+ */
+volatile int smp_released = 0;
+
+/**
+ * @brief smp_release releases secondary harts parking in start.S. Must be called
+ *        by hart 0 after all global initialization is done.
+ */
+void smp_release(void){
+    // make sure all the initialization is visible to other harts before releasing them
+    __sync_synchronize();
+    smp_released = 1;
+    __sync_synchronize();
+
+    // wake up all other harts with IPI, writes to harts that don't exist are ignored by CLINT
+    for (int id = 0; id < MAXNUM_CPU; id++) {
+        if (id != r_tp())
+            *(volatile uint32_t *)CLINT_MSIP(id) = 1;
+    }
+}
+
+/*
+ * _boot_report is the first task to run on hart 0, it prints how many cycles each
+ * stage of the boot took and exits.
+ */
+static void _boot_report(void *param){
+    static const char *stages[BOOT_NR] = {
+        "_start", "bss cleared", "start_kernel", "init done", "first task",
+    };
+
+    boot_cycles[BOOT_TASK] = r_mcycle();
+    printf("boot: %u cycles to _start\n", boot_cycles[BOOT_START]);
+    for (int i = BOOT_BSS; i < BOOT_NR; i++)
+        printf("boot: %u cycles to %s (+%u)\n", boot_cycles[i] - boot_cycles[BOOT_START],
+               stages[i], boot_cycles[i] - boot_cycles[i - 1]);
+}
+
+/**
+ * @brief start_kernel is the C entry of hart 0, see start.S
+ *
+ * @param fdt the flattened device tree passed by QEMU
+ */
+void start_kernel(void *fdt){
+    boot_cycles[BOOT_KERNEL] = r_mcycle();
+
+    // drivers register their interrupts to PLIC from now on
+    plic_init();
 
     // init uart
     uart_init();
+    printf_init();
     uart_puts("Hello JackOS-riscv!\n");
 
+    // size the heap before page_init() builds the allocator on it
+    fdt_init(fdt);
     page_init();
+    slab_init();
+    virtio_blk_init();
     sched_init();
+    bio_init();
+
+    smp_release();
+    boot_cycles[BOOT_INIT] = r_mcycle();
+
+    trap_init();
+    timer_init();
+    sched_init_hart();
+
+    // highest priority and pinned to hart 0, so that it runs first and reads mcycle of hart 0
+    task_create_affinity(_boot_report, NULL, 0, 1U << 0);
+
+#ifdef CONFIG_TRACE
+    trace_start();
+#endif
+
+#ifdef CONFIG_BENCH
+    bench_start();
+#else
+    os_main();
+#endif
 
     schedule();
     
     uart_puts("Would not be here!\n");
 
     while (1);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief start_secondary is the C entry of secondary harts, see start.S
+ */
+void start_secondary(void){
+    // acknowledge the IPI which woke us up
+    *(volatile uint32_t *)CLINT_MSIP(r_tp()) = 0;
+
+    trap_init();
+    timer_init();
+    sched_init_hart();
+
+    // tasks are created by hart 0, we steal them when we are idle
+    schedule();
+
+    uart_puts("Would not be here!\n");
+
+    while (1);
+}
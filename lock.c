@@ -0,0 +1,248 @@
+/**
+ * @file lock.c
+ * @author Jack Wang
+ * @brief Spinlocks and ticket locks built on the A extension of rv32ima.
+ *        - spinlock: test and test-and-set with amoswap.w.aq/rl, cheap but unfair
+ *        - ticket lock: take a ticket with amoadd.w and wait for it to be served, FIFO fair
+ *        The _irqsave variants also disable interrupts of current hart while holding the lock,
+ *        so that the holder is never preempted, and the lock can be taken in interrupt handlers.
+ *        Each lock counts how many times it is acquired, how many of them have to wait and
+ *        how many times they spin, see lock_stats_print().
+ * @version 0.1
+ * @date 2023-04-23
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ */
+#include "os.h"
+
+/*
+ * registered locks, printed by lock_stats_print(). Counters live in the locks and are
+ * linked into a list, so that any number of locks can be registered. Locks are pushed
+ * with a CAS, because harts may initialize their locks at the same time.
+ */
+static lock_stat_t *volatile _stats = NULL;
+
+static void _stat_register(lock_stat_t *stat, const char *name)
+{
+    stat->name = name;
+    stat->acquires = 0;
+    stat->contended = 0;
+    stat->spins = 0;
+    do {
+        stat->next = _stats;
+    } while (!__sync_bool_compare_and_swap(&_stats, stat->next, stat));
+}
+
+/*
+ * counters are updated while holding the lock, so no atomic operation is needed
+ */
+static inline void _stat_acquired(lock_stat_t *stat, uint32_t spins)
+{
+    stat->acquires++;
+    if (spins) {
+        stat->contended++;
+        stat->spins += spins;
+    }
+}
+
+static inline uint32_t _amoswap_aq(volatile uint32_t *addr, uint32_t value)
+{
+    uint32_t old;
+    asm volatile("amoswap.w.aq %0, %2, %1" : "=r" (old), "+A" (*addr) : "r" (value) : "memory");
+    return old;
+}
+
+static inline void _amoswap_rl_zero(volatile uint32_t *addr)
+{
+    asm volatile("amoswap.w.rl zero, zero, %0" : "+A" (*addr) : : "memory");
+}
+
+static inline uint32_t _amoadd(volatile uint32_t *addr, uint32_t value)
+{
+    uint32_t old;
+    asm volatile("amoadd.w %0, %2, %1" : "=r" (old), "+A" (*addr) : "r" (value) : "memory");
+    return old;
+}
+
+/**
+ * @brief spin_init initializes a spinlock and registers its counters
+ * 
+ * @param lock lock to initialize
+ * @param name name of the lock, shown by lock_stats_print()
+ */
+void spin_init(spinlock_t *lock, const char *name)
+{
+    lock->locked = 0;
+    lock->hart = -1;
+    _stat_register(&lock->stat, name);
+}
+
+/**
+ * @brief spin_lock acquires a spinlock
+ * 
+ * @param lock lock to acquire
+ */
+void spin_lock(spinlock_t *lock)
+{
+    uint32_t spins = 0;
+    while (_amoswap_aq(&lock->locked, 1)) {
+        // wait with plain loads, so that the cache line is not bounced by amoswap
+        while (lock->locked)
+            spins++;
+    }
+    lock->hart = r_tp();
+    _stat_acquired(&lock->stat, spins);
+}
+
+/**
+ * @brief spin_trylock tries to acquire a spinlock without waiting
+ * 
+ * @param lock lock to acquire
+ * @return int 1 if acquired, 0 if not
+ */
+int spin_trylock(spinlock_t *lock)
+{
+    if (lock->locked || _amoswap_aq(&lock->locked, 1))
+        return 0;
+    lock->hart = r_tp();
+    _stat_acquired(&lock->stat, 0);
+    return 1;
+}
+
+/**
+ * @brief spin_unlock releases a spinlock
+ * 
+ * @param lock lock to release
+ */
+void spin_unlock(spinlock_t *lock)
+{
+    lock->hart = -1;
+    _amoswap_rl_zero(&lock->locked);
+}
+
+/**
+ * @brief spin_lock_irqsave disables interrupts of current hart and acquires a spinlock
+ * 
+ * @param lock lock to acquire
+ * @return reg_t previous interrupt state, passed to spin_unlock_irqrestore()
+ */
+reg_t spin_lock_irqsave(spinlock_t *lock)
+{
+    reg_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * @brief spin_unlock_irqrestore releases a spinlock and restores interrupts of current hart
+ * 
+ * @param lock lock to release
+ * @param flags interrupt state returned by spin_lock_irqsave()
+ */
+void spin_unlock_irqrestore(spinlock_t *lock, reg_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+/**
+ * @brief spin_holding checks if current hart holds the spinlock
+ * 
+ * @param lock lock to check
+ * @return int 1 if held by current hart
+ */
+int spin_holding(spinlock_t *lock)
+{
+    return lock->locked && lock->hart == r_tp();
+}
+
+/**
+ * @brief ticket_init initializes a ticket lock and registers its counters
+ * 
+ * @param lock lock to initialize
+ * @param name name of the lock, shown by lock_stats_print()
+ */
+void ticket_init(ticketlock_t *lock, const char *name)
+{
+    lock->next = 0;
+    lock->owner = 0;
+    lock->hart = -1;
+    _stat_register(&lock->stat, name);
+}
+
+/**
+ * @brief ticket_lock acquires a ticket lock, harts get the lock in the order they ask for it
+ * 
+ * @param lock lock to acquire
+ */
+void ticket_lock(ticketlock_t *lock)
+{
+    uint32_t spins = 0;
+    uint32_t ticket = _amoadd(&lock->next, 1);
+    while (lock->owner != ticket)
+        spins++;
+    // acquire: accesses in the critical section must not happen before we see our ticket served
+    asm volatile("fence r, rw" : : : "memory");
+    lock->hart = r_tp();
+    _stat_acquired(&lock->stat, spins);
+}
+
+/**
+ * @brief ticket_unlock releases a ticket lock, and serves the next ticket
+ * 
+ * @param lock lock to release
+ */
+void ticket_unlock(ticketlock_t *lock)
+{
+    lock->hart = -1;
+    // release: accesses in the critical section must be done before the next ticket is served
+    asm volatile("fence rw, w" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+/**
+ * @brief ticket_lock_irqsave disables interrupts of current hart and acquires a ticket lock
+ * 
+ * @param lock lock to acquire
+ * @return reg_t previous interrupt state, passed to ticket_unlock_irqrestore()
+ */
+reg_t ticket_lock_irqsave(ticketlock_t *lock)
+{
+    reg_t flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+/**
+ * @brief ticket_unlock_irqrestore releases a ticket lock and restores interrupts of current hart
+ * 
+ * @param lock lock to release
+ * @param flags interrupt state returned by ticket_lock_irqsave()
+ */
+void ticket_unlock_irqrestore(ticketlock_t *lock, reg_t flags)
+{
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+/**
+ * @brief ticket_holding checks if current hart holds the ticket lock
+ * 
+ * @param lock lock to check
+ * @return int 1 if held by current hart
+ */
+int ticket_holding(ticketlock_t *lock)
+{
+    return lock->next != lock->owner && lock->hart == r_tp();
+}
+
+/**
+ * @brief lock_stats_print prints contention counters of all registered locks
+ */
+void lock_stats_print()
+{
+    printf("%-16s %10s %10s %12s\n", "lock", "acquires", "contended", "spins");
+    for (lock_stat_t *stat = _stats; stat; stat = stat->next)
+        printf("%-16s %10u %10u %12u\n", stat->name, stat->acquires, stat->contended, stat->spins);
+}
@@ -1,9 +1,10 @@
 /**
  * @file page.c
  * @author Jack Wang
- * @brief A simple physical memory management. 
+ * @brief A simple physical memory management, based on the buddy system (or bitmaps, see Makefile). 
  * 		  There will be no virtual memory management, we simple allocate physical pages. 
- * 		  Currently, there's no lock, so the operating of allocatable page flag array is dangerous
+ * 		  Page state is protected by a spinlock, so that harts can allocate and free pages concurrently.
+ * 		  Single pages go through a per-hart page cache first, which refills and drains in batches.
  * @version 0.1
  * @date 2023-04-02
  * 
@@ -42,7 +43,7 @@
  * 			  e				|									|
  * 			  a				|									|
  * 							|									|
- * 		0x8800-0000			|-----------------------------------|	<---- HEAP_END,		MEMORY_END
+ * 		0x8800-0000			|-----------------------------------|	<---- HEAP_END,		MEMORY_END (128M, see fdt.c)
  * 							|									|
  * 							|									|
  * 							|	  Other Device Mapping Area		|
@@ -54,15 +55,15 @@
 /*
  * Following global vars are defined in mem.S
  */
-extern uint32_t TEXT_START;
-extern uint32_t TEXT_END;
-extern uint32_t DATA_START;
-extern uint32_t DATA_END;
-extern uint32_t RODATA_START;
-extern uint32_t RODATA_END;
-extern uint32_t BSS_START;
-extern uint32_t BSS_END;
-extern uint32_t HEAP_START;
+extern uintptr_t TEXT_START;
+extern uintptr_t TEXT_END;
+extern uintptr_t DATA_START;
+extern uintptr_t DATA_END;
+extern uintptr_t RODATA_START;
+extern uintptr_t RODATA_END;
+extern uintptr_t BSS_START;
+extern uintptr_t BSS_END;
+extern uintptr_t HEAP_START;
 extern uint32_t HEAP_SIZE;
 
 
@@ -125,29 +126,94 @@ extern uint32_t HEAP_SIZE;
  * _alloc_end points to the actual end address of heap pool
  * _num_pages holds the actual max number of pages we can allocate.
  */
-static uint32_t _alloc_start = 0;
-static uint32_t _alloc_end = 0;
+static uintptr_t _alloc_start = 0;
+static uintptr_t _alloc_end = 0;
 static uint32_t _num_pages = 0;
 
-#define PAGE_SIZE 4096
-#define PAGE_ORDER 12
+/*
+ * _page_lock protects page state metadata of both backends, and the zeroed page pool
+ */
+static spinlock_t _page_lock;
+
+/*
+ * convert between page id (counted from _alloc_start) and page address
+ */
+static inline uint32_t _page_id(void *p)
+{
+	return ((uintptr_t)p - _alloc_start) >> PAGE_ORDER;
+}
+
+static inline void *_page_addr(uint32_t id)
+{
+	return (void *)(_alloc_start + ((uintptr_t)id << PAGE_ORDER));
+}
+
+/*
+ * align the address to the border of page(4K)
+ */
+static inline uintptr_t _align_page(uintptr_t address)
+{
+	// order = 4095, 0x0FFF, 0b0000_1111_1111_1111
+	uintptr_t order = (1 << PAGE_ORDER) - 1;
+	return (address + order) & (~order);
+}
+
+/*
+ * There are two page state backends, selected by PAGE_ALLOCATOR in Makefile:
+ * 	- buddy (default): byte descriptors + buddy system, see below
+ * 	- bitmap: TAKEN/LAST bitmaps + next-fit search, defines CONFIG_PAGE_BITMAP
+ * Each backend provides:
+ * 	- _meta_size(npages): bytes of metadata needed to manage npages pages
+ * 	- _pool_init(): initialize metadata of the heap pool
+ * 	- _pool_alloc(npages)/_pool_free(p): allocate/free a memory block
+ * 	- _pool_is_single(p): check if p is an allocated block of exactly one page
+ */
+#ifndef CONFIG_PAGE_BITMAP
+
+/*
+ * MAX_ORDER is the order of the largest block managed by the buddy system,
+ * i.e., 2^15 pages = 128 MB. Larger heaps are simply cut into several blocks
+ * of MAX_ORDER.
+ */
+#define MAX_ORDER 15
 
 #define PAGE_TAKEN (uint8_t)(1 << 0)
-#define PAGE_LAST  (uint8_t)(1 << 1)
+#define PAGE_HEAD  (uint8_t)(1 << 1)
+
+#define BLOCK_ORDER_SHIFT 3
 
 /*
  * Page Descriptor 
- *		A descriptor is a byte, which describe a page. We will take first 8 pages to store descriptors.
- *		So, there will be 8 * 4096 = 32768 pages, which manage 32768 * 4K = 128 MB memory.
+ *		A descriptor is a byte, which describe a page. Descriptors are stored at the start of heap,
+ *		e.g., 8 pages of descriptors manage 8 * 4096 = 32768 pages, i.e., 32768 * 4K = 128 MB memory.
+ *		Only the first page of a block (free or allocated) carries information, descriptors of
+ *		the other pages in the block are always zero.
  * flags:
- * 		- bit 0: flag if this page is taken(allocated)
- * 		- bit 1: flag if this page is the last page of the memory block allocated
- * 		- bit 2-7: reserved
+ * 		- bit 0: flag if this block is taken(allocated)
+ * 		- bit 1: flag if this page is the first page of a block
+ * 		- bit 2: reserved
+ * 		- bit 3-7: order of the block, i.e., the block has 2^order pages
  */
 struct Page {
 	uint8_t flags;
 };
 
+/*
+ * Free Block
+ *		Free blocks are linked into the free list of their order. The list node is
+ *		stored in the first bytes of the free block itself, so the buddy system
+ *		needs no memory other than the page descriptors.
+ */
+struct FreeBlock {
+	struct FreeBlock *next;
+	struct FreeBlock *prev;
+};
+
+/*
+ * _free_area[order] is the head of the list of free blocks with 2^order pages
+ */
+static struct FreeBlock *_free_area[MAX_ORDER + 1];
+
 static inline void _clear(struct Page *page)
 {
 	page->flags = 0;
@@ -158,49 +224,474 @@ static inline int _is_free(struct Page *page)
 	return page->flags & PAGE_TAKEN ? 0 : 1;
 }
 
-static inline void _set_flag(struct Page *page, uint8_t flags)
+static inline int _is_head(struct Page *page)
+{
+	return page->flags & PAGE_HEAD ? 1 : 0;
+}
+
+static inline int _get_order(struct Page *page)
 {
-	page->flags |= flags;
+	return page->flags >> BLOCK_ORDER_SHIFT;
 }
 
-static inline int _is_last(struct Page *page)
+static inline void _set_head(struct Page *page, int order, uint8_t flags)
 {
-	return page->flags & PAGE_LAST ? 1 : 0;
+	page->flags = PAGE_HEAD | flags | (uint8_t)(order << BLOCK_ORDER_SHIFT);
+}
+
+static inline struct Page *_page_desc(uint32_t id)
+{
+	return (struct Page *)HEAP_START + id;
+}
+
+static inline uint32_t _meta_size(uint32_t npages)
+{
+	return npages * sizeof(struct Page);
 }
 
 /*
- * align the address to the border of page(4K)
+ * get the smallest order whose block can hold npages
  */
-static inline uint32_t _align_page(uint32_t address)
+static inline int _order_of(int npages)
 {
-	// order = 4095, 0x0FFF, 0b0000_1111_1111_1111
-	uint32_t order = (1 << PAGE_ORDER) - 1;
-	return (address + order) & (~order);
+	int order = 0;
+	while ((1 << order) < npages)
+		order++;
+	return order;
+}
+
+/*
+ * push the free block starting at page id to the free list of given order
+ */
+static void _free_list_add(uint32_t id, int order)
+{
+	struct FreeBlock *block = (struct FreeBlock *)_page_addr(id);
+	block->prev = NULL;
+	block->next = _free_area[order];
+	if (block->next)
+		block->next->prev = block;
+	_free_area[order] = block;
+	_set_head(_page_desc(id), order, 0);
+}
+
+/*
+ * remove the free block starting at page id from the free list of given order
+ */
+static void _free_list_del(uint32_t id, int order)
+{
+	struct FreeBlock *block = (struct FreeBlock *)_page_addr(id);
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		_free_area[order] = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	_clear(_page_desc(id));
+}
+
+static void _pool_init()
+{
+	memset((void *)HEAP_START, 0, _num_pages * sizeof(struct Page));
+
+	/*
+	 * The heap is not a power of two pages, so we cut it into the largest
+	 * blocks which are naturally aligned (with respect to _alloc_start) and
+	 * put them to the free lists.
+	 */
+	for (int order = 0; order <= MAX_ORDER; order++)
+		_free_area[order] = NULL;
+
+	uint32_t id = 0;
+	while (id < _num_pages) {
+		int order = MAX_ORDER;
+		while (order > 0 && ((id & ((1 << order) - 1)) || id + (1 << order) > _num_pages))
+			order--;
+		_free_list_add(id, order);
+		id += 1 << order;
+	}
+}
+
+/*
+ * npages will be rounded up to the power of 2
+ */
+static void *_pool_alloc(int npages)
+{
+	int order = _order_of(npages);
+	if (order > MAX_ORDER)
+		return NULL;
+
+	/* find the smallest free block which is large enough */
+	int o = order;
+	while (o <= MAX_ORDER && _free_area[o] == NULL)
+		o++;
+	if (o > MAX_ORDER)
+		return NULL;
+
+	uint32_t id = _page_id(_free_area[o]);
+	_free_list_del(id, o);
+
+	/*
+	 * split the block until it fits, the upper halves are given back
+	 * to the free lists of lower orders
+	 */
+	while (o > order) {
+		o--;
+		_free_list_add(id + (1 << o), o);
+	}
+
+	_set_head(_page_desc(id), order, PAGE_TAKEN);
+	return _page_addr(id);
+}
+
+/*
+ * check if p is an allocated block of exactly one page
+ */
+static int _pool_is_single(void *p)
+{
+	struct Page *page = _page_desc(_page_id(p));
+	return _is_head(page) && !_is_free(page) && _get_order(page) == 0;
+}
+
+static void _pool_free(void *p)
+{
+	/* get the first page descriptor of this memory block */
+	uint32_t id = _page_id(p);
+	struct Page *page = _page_desc(id);
+	if (!_is_head(page) || _is_free(page)) {
+		return;
+	}
+
+	int order = _get_order(page);
+	_clear(page);
+
+	/* merge with the buddy as long as the buddy is a free block of the same order */
+	while (order < MAX_ORDER) {
+		uint32_t buddy = id ^ (1 << order);
+		if (buddy + (1 << order) > _num_pages)
+			break;
+		struct Page *bpage = _page_desc(buddy);
+		if (!_is_head(bpage) || !_is_free(bpage) || _get_order(bpage) != order)
+			break;
+		_free_list_del(buddy, order);
+		id &= ~(1 << order);
+		order++;
+	}
+	_free_list_add(id, order);
+}
+
+#else /* CONFIG_PAGE_BITMAP */
+
+/*
+ * Page Bitmaps
+ *		Bit i of _taken flags if page i is taken(allocated), bit i of _last flags if page i
+ *		is the last page of the memory block allocated. So each page costs 2 bits only.
+ *		Both bitmaps are stored at the start of heap, and searched a word (32 pages) at a time.
+ *		Bits beyond _num_pages in the last word of _taken are always set, so that the search
+ *		never runs out of the heap pool.
+ */
+static uint32_t *_taken = NULL;
+static uint32_t *_last = NULL;
+static uint32_t _nwords = 0;
+
+/*
+ * _hint is the word to start the next search from (next-fit), so that repeated small
+ * allocations do not rescan the allocated pages at the beginning of heap
+ */
+static uint32_t _hint = 0;
+
+static inline uint32_t _meta_size(uint32_t npages)
+{
+	// 2 bitmaps, plus 4 bytes to align HEAP_START to word
+	return 2 * ((npages + 31) / 32) * sizeof(uint32_t) + sizeof(uint32_t);
+}
+
+static inline int _test_bit(uint32_t *map, uint32_t i)
+{
+	return (map[i >> 5] >> (i & 31)) & 1;
+}
+
+/*
+ * mask of bits [lo, hi) in a word, 0 <= lo < hi <= 32
+ */
+static inline uint32_t _mask(int lo, int hi)
+{
+	uint32_t m = hi == 32 ? ~0U : ((1U << hi) - 1);
+	return m & ~((1U << lo) - 1);
+}
+
+/*
+ * set (or clear) bits [start, start + n) of map, a word at a time
+ */
+static void _set_bits(uint32_t *map, uint32_t start, uint32_t n, int set)
+{
+	while (n) {
+		int lo = start & 31;
+		int len = 32 - lo < n ? 32 - lo : n;
+		uint32_t m = _mask(lo, lo + len);
+		if (set)
+			map[start >> 5] |= m;
+		else
+			map[start >> 5] &= ~m;
+		start += len;
+		n -= len;
+	}
+}
+
+static void _pool_init()
+{
+	_nwords = (_num_pages + 31) / 32;
+	_taken = (uint32_t *)((HEAP_START + 3) & ~3);
+	_last = _taken + _nwords;
+	memset(_taken, 0, 2 * _nwords * sizeof(uint32_t));
+	if (_num_pages & 31)
+		_taken[_nwords - 1] = _mask(_num_pages & 31, 32);
+	_hint = 0;
+}
+
+/*
+ * search words [from, to) for npages contiguous free pages
+ * return the first page id of the run, or -1 if not found
+ */
+static int _search(uint32_t from, uint32_t to, uint32_t npages)
+{
+	uint32_t run = 0, run_start = 0;
+	for (uint32_t w = from; w < to; w++) {
+		uint32_t free = ~_taken[w];
+		if (free == ~0U) {
+			// whole word is free, extend the run
+			if (run == 0)
+				run_start = w << 5;
+			run += 32;
+			if (run >= npages)
+				return run_start;
+			continue;
+		}
+		if (free == 0) {
+			run = 0;
+			continue;
+		}
+		// continue the run from previous word with trailing free pages
+		if (run) {
+			uint32_t len = ctz32(~free);
+			if (run + len >= npages)
+				return run_start;
+			run = 0;
+		}
+		// find runs of free pages inside the word
+		int bit = 0;
+		while (free) {
+			int start = ctz32(free);
+			uint32_t rest = ~(free >> start);
+			int len = rest ? ctz32(rest) : 32 - start;
+			if (len >= npages)
+				return (w << 5) + start;
+			if (start + len == 32) {
+				// run reaches the end of word, may continue in next word
+				run = len;
+				run_start = (w << 5) + start;
+				break;
+			}
+			bit = start + len;
+			free &= ~_mask(0, bit);
+		}
+	}
+	return -1;
+}
+
+static void *_pool_alloc(int npages)
+{
+	if (npages > _num_pages)
+		return NULL;
+	int id = _search(_hint, _nwords, npages);
+	if (id < 0)
+		id = _search(0, _nwords, npages);
+	if (id < 0)
+		return NULL;
+
+	_set_bits(_taken, id, npages, 1);
+	_set_bits(_last, id + npages - 1, 1, 1);
+	_hint = (id + npages) >> 5;
+	if (_hint >= _nwords)
+		_hint = 0;
+	return _page_addr(id);
+}
+
+/*
+ * check if p is an allocated block of exactly one page
+ */
+static int _pool_is_single(void *p)
+{
+	uint32_t id = _page_id(p);
+	if (!_test_bit(_taken, id) || !_test_bit(_last, id))
+		return 0;
+	return id == 0 || !_test_bit(_taken, id - 1) || _test_bit(_last, id - 1);
+}
+
+static void _pool_free(void *p)
+{
+	uint32_t id = _page_id(p);
+	/* p must be the first page of a memory block */
+	if (!_test_bit(_taken, id))
+		return;
+	if (id > 0 && _test_bit(_taken, id - 1) && !_test_bit(_last, id - 1))
+		return;
+
+	/* find the last page of this memory block */
+	uint32_t w = id >> 5;
+	uint32_t last = _last[w] & _mask(id & 31, 32);
+	while (last == 0 && ++w < _nwords)
+		last = _last[w];
+	/* no LAST bit up to the end of the pool, the bitmaps are corrupted */
+	if (last == 0)
+		return;
+	uint32_t end = (w << 5) + ctz32(last);
+
+	_set_bits(_taken, id, end - id + 1, 0);
+	_set_bits(_last, end, 1, 0);
+}
+
+#endif /* CONFIG_PAGE_BITMAP */
+
+/*
+ * Per-hart Page Cache
+ *		Single pages are allocated from and freed to a small cache of the current hart, indexed by
+ *		the hart id in tp. The cache is only touched by its own hart with interrupts disabled, so
+ *		no lock is needed. It talks to the global pool in batches, so that _page_lock is taken
+ *		once per batch instead of once per page:
+ *			- when the cache is empty, batch pages are taken from the global pool
+ *			- when the cache holds more than high pages, pages are given back until low are left
+ */
+#define PAGE_CACHE_SIZE 64
+
+struct page_cache {
+	void *pages[PAGE_CACHE_SIZE];
+	int count;
+};
+
+static struct page_cache _page_cache[MAXNUM_CPU];
+static int _cache_low = 8;
+static int _cache_high = 32;
+static int _cache_batch = 16;
+
+/*
+ * refill the cache of current hart from the global pool, must be called with interrupts disabled
+ */
+static void _cache_refill(struct page_cache *pc)
+{
+	spin_lock(&_page_lock);
+	while (pc->count < _cache_batch) {
+		void *p = _pool_alloc(1);
+		if (p == NULL)
+			break;
+		pc->pages[pc->count++] = p;
+	}
+	spin_unlock(&_page_lock);
+}
+
+/*
+ * give back pages of the cache of current hart to the global pool until keep pages are left,
+ * must be called with interrupts disabled
+ */
+static void _cache_drain(struct page_cache *pc, int keep)
+{
+	spin_lock(&_page_lock);
+	while (pc->count > keep)
+		_pool_free(pc->pages[--pc->count]);
+	spin_unlock(&_page_lock);
+}
+
+/*
+ * Zeroed Page Pool
+ *		page_alloc_zeroed() takes single pages from a global pool of pages which are zeroed
+ *		already, so that callers needing clean memory don't zero 4 KB on their critical path.
+ *		Idle harts refill the pool by page_zero_refill(), and page_alloc_zeroed() falls back
+ *		to zeroing inline when the pool is empty. Pages in the pool are allocated as far as
+ *		the backends know, they are given back when page_alloc() runs out of memory. They are
+ *		traced as allocated only once handed out, so that traces count them as free memory.
+ */
+#define PAGE_ZERO_POOL_SIZE 32
+
+static void *_zero_pool[PAGE_ZERO_POOL_SIZE];
+static int _zero_count = 0;
+
+/*
+ * take a page from the zeroed pool, NULL if it is empty, must be called with interrupts disabled
+ */
+static void *_zero_take()
+{
+	void *p = NULL;
+	spin_lock(&_page_lock);
+	if (_zero_count > 0)
+		p = _zero_pool[--_zero_count];
+	spin_unlock(&_page_lock);
+	return p;
+}
+
+/*
+ * give back all pages of the zeroed pool to the global pool, returns the number of pages,
+ * must be called with interrupts disabled
+ */
+static int _zero_release()
+{
+	spin_lock(&_page_lock);
+	int n = _zero_count;
+	while (_zero_count > 0)
+		_pool_free(_zero_pool[--_zero_count]);
+	spin_unlock(&_page_lock);
+	return n;
+}
+
+/**
+ * @brief page_cache_tune sets watermarks of per-hart page caches
+ * 
+ * @param low pages left in cache after draining
+ * @param high cache is drained when it holds more than high pages, below PAGE_CACHE_SIZE
+ *             since page_free() stores a page before checking it
+ * @param batch pages taken from the global pool when cache is empty
+ * @return int 0 if success, -1 if watermarks are invalid
+ */
+int page_cache_tune(int low, int high, int batch)
+{
+	if (low < 0 || low >= high || high >= PAGE_CACHE_SIZE || batch <= 0 || batch > high)
+		return -1;
+	_cache_low = low;
+	_cache_high = high;
+	_cache_batch = batch;
+	return 0;
+}
+
+/**
+ * @brief page_cache_drain gives back all pages cached by current hart to the global pool
+ */
+void page_cache_drain()
+{
+	reg_t flags = irq_save();
+	_cache_drain(&_page_cache[r_tp()], 0);
+	irq_restore(flags);
 }
 
 void page_init()
 {
 	/* 
-	 * We reserved 8 Page (8 x 4096) to hold the Page structures.
-	 * It should be enough to manage at most 128 MB (8 x 4096 x 4096) 
+	 * Page state metadata is kept at the start of heap, reserve enough pages to hold it.
+	 * e.g., the byte descriptors need 8 pages (8 x 4096) to manage 128 MB (8 x 4096 x 4096),
+	 * while the bitmaps need only 1 page.
 	 */
-	_num_pages = (HEAP_SIZE / PAGE_SIZE) - 8;
-	printf("HEAP_START = %x, HEAP_SIZE = %x, num of pages = %d\n", HEAP_START, HEAP_SIZE, _num_pages);
-	
-	struct Page *page = (struct Page *)HEAP_START;
-	for (int i = 0; i < _num_pages; i++) {
-		_clear(page);
-		page++;	
-	}
+	uint32_t meta_pages = (_meta_size(HEAP_SIZE / PAGE_SIZE) + PAGE_SIZE - 1) / PAGE_SIZE;
+	_num_pages = (HEAP_SIZE / PAGE_SIZE) - meta_pages;
+	printf("HEAP_START = %p, HEAP_SIZE = %x, num of pages = %d\n", (void *)HEAP_START, HEAP_SIZE, _num_pages);
 
-	_alloc_start = _align_page(HEAP_START + 8 * PAGE_SIZE);
+	_alloc_start = _align_page(HEAP_START + meta_pages * PAGE_SIZE);
 	_alloc_end = _alloc_start + (PAGE_SIZE * _num_pages);
 
-	printf("TEXT:   0x%x -> 0x%x\n", TEXT_START, TEXT_END);
-	printf("RODATA: 0x%x -> 0x%x\n", RODATA_START, RODATA_END);
-	printf("DATA:   0x%x -> 0x%x\n", DATA_START, DATA_END);
-	printf("BSS:    0x%x -> 0x%x\n", BSS_START, BSS_END);
-	printf("HEAP:   0x%x -> 0x%x\n", _alloc_start, _alloc_end);
+	spin_init(&_page_lock, "page");
+	_pool_init();
+
+	printf("TEXT:   %p -> %p\n", (void *)TEXT_START, (void *)TEXT_END);
+	printf("RODATA: %p -> %p\n", (void *)RODATA_START, (void *)RODATA_END);
+	printf("DATA:   %p -> %p\n", (void *)DATA_START, (void *)DATA_END);
+	printf("BSS:    %p -> %p\n", (void *)BSS_START, (void *)BSS_END);
+	printf("HEAP:   %p -> %p\n", (void *)_alloc_start, (void *)_alloc_end);
 }
 
 /*
@@ -209,43 +700,40 @@ void page_init()
  */
 void *page_alloc(int npages)
 {
-	/* Note we are searching the page descriptor bitmaps. */
-	int found = 0;
-	struct Page *page_i = (struct Page *)HEAP_START;
-	for (int i = 0; i <= (_num_pages - npages); i++) {
-		if (_is_free(page_i)) {
-			found = 1;
-			/* 
-			 * meet a free page, continue to check if following
-			 * (npages - 1) pages are also unallocated.
-			 */
-			struct Page *page_j = page_i + 1;
-			for (int j = i + 1; j < (i + npages); j++) {
-				if (!_is_free(page_j)) {
-					found = 0;
-					break;
-				}
-				page_j++;
-			}
-			/*
-			 * get a memory block which is good enough for us,
-			 * take housekeeping, then return the actual start
-			 * address of the first page of this memory block
-			 */
-			if (found) {
-				struct Page *page_k = page_i;
-				for (int k = i; k < (i + npages); k++) {
-					_set_flag(page_k, PAGE_TAKEN);
-					page_k++;
-				}
-				page_k--;
-				_set_flag(page_k, PAGE_LAST);
-				return (void *)(_alloc_start + i * PAGE_SIZE);
-			}
+	if (npages <= 0)
+		return NULL;
+
+	void *p = NULL;
+	reg_t flags = irq_save();
+	struct page_cache *pc = &_page_cache[r_tp()];
+	if (npages == 1) {
+		if (pc->count == 0)
+			_cache_refill(pc);
+		if (pc->count > 0)
+			p = pc->pages[--pc->count];
+		else
+			/* out of memory, a zeroed page is as good as any */
+			p = _zero_take();
+	} else {
+		spin_lock(&_page_lock);
+		p = _pool_alloc(npages);
+		spin_unlock(&_page_lock);
+		if (p == NULL && pc->count > 0) {
+			/* pages held by our cache may be what we need to make a large block */
+			_cache_drain(pc, 0);
+			spin_lock(&_page_lock);
+			p = _pool_alloc(npages);
+			spin_unlock(&_page_lock);
+		}
+		if (p == NULL && _zero_release() > 0) {
+			spin_lock(&_page_lock);
+			p = _pool_alloc(npages);
+			spin_unlock(&_page_lock);
 		}
-		page_i++;
 	}
-	return NULL;
+	irq_restore(flags);
+	TRACE(TRACE_PAGE_ALLOC, npages, p, 0);
+	return p;
 }
 
 /*
@@ -257,34 +745,109 @@ void page_free(void *p)
 	/*
 	 * Assert (TBD) if p is invalid
 	 */
-	if (!p || (uint32_t)p >= _alloc_end) {
+	if (!p || (uintptr_t)p < _alloc_start || (uintptr_t)p >= _alloc_end) {
 		return;
 	}
-	/* get the first page descriptor of this memory block */
-	struct Page *page = (struct Page *)HEAP_START;
-	page += ((uint32_t)p - _alloc_start)/ PAGE_SIZE;
-	/* loop and clear all the page descriptors of the memory block */
-	while (!_is_free(page)) {
-		if (_is_last(page)) {
-			_clear(page);
-			break;
-		} else {
-			_clear(page);
-			page++;;
+
+	TRACE(TRACE_PAGE_FREE, p, 0, 0);
+	reg_t flags = irq_save();
+	struct page_cache *pc = &_page_cache[r_tp()];
+	if (_pool_is_single(p)) {
+		pc->pages[pc->count++] = p;
+		if (pc->count > _cache_high)
+			_cache_drain(pc, _cache_low);
+	} else {
+		spin_lock(&_page_lock);
+		_pool_free(p);
+		spin_unlock(&_page_lock);
+	}
+	irq_restore(flags);
+}
+
+/*
+ * Allocate a memory block of zeroed pages, single pages come from the zeroed pool if possible
+ * - npages: the number of PAGE_SIZE pages to allocate
+ */
+void *page_alloc_zeroed(int npages)
+{
+	if (npages == 1) {
+		reg_t flags = irq_save();
+		void *p = _zero_take();
+		irq_restore(flags);
+		if (p) {
+			TRACE(TRACE_PAGE_ALLOC, 1, p, 0);
+			return p;
 		}
 	}
+
+	uint8_t *p = page_alloc(npages);
+	if (p == NULL)
+		return NULL;
+	for (int i = 0; i < npages; i++)
+		memzero_page(p + i * PAGE_SIZE);
+	return p;
+}
+
+/*
+ * Zero a page into the zeroed pool, called by idle harts. Returns 1 if a page was added,
+ * 0 if the pool is full or memory is out. Interrupts stay enabled while zeroing.
+ */
+int page_zero_refill()
+{
+	void *p = NULL;
+	reg_t flags = irq_save();
+	spin_lock(&_page_lock);
+	int full = _zero_count >= PAGE_ZERO_POOL_SIZE;
+	spin_unlock(&_page_lock);
+	if (!full) {
+		/* not by page_alloc(), which would take the page back from the zeroed pool when out of memory */
+		struct page_cache *pc = &_page_cache[r_tp()];
+		if (pc->count == 0)
+			_cache_refill(pc);
+		if (pc->count > 0)
+			p = pc->pages[--pc->count];
+	}
+	irq_restore(flags);
+	if (p == NULL)
+		return 0;
+	memzero_page(p);
+
+	flags = irq_save();
+	spin_lock(&_page_lock);
+	if (_zero_count < PAGE_ZERO_POOL_SIZE) {
+		_zero_pool[_zero_count++] = p;
+		p = NULL;
+	}
+	spin_unlock(&_page_lock);
+	irq_restore(flags);
+	/* another hart filled the pool meanwhile */
+	if (p) {
+		page_free(p);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Give back all pages of the zeroed pool to the global pool
+ */
+void page_zero_drain()
+{
+	reg_t flags = irq_save();
+	_zero_release();
+	irq_restore(flags);
 }
 
 void page_test()
 {
 	void *p = page_alloc(2);
-	printf("p = 0x%x\n", p);
+	printf("p = %p\n", p);
 	//page_free(p);
 
 	void *p2 = page_alloc(7);
-	printf("p2 = 0x%x\n", p2);
+	printf("p2 = %p\n", p2);
 	page_free(p2);
 
 	void *p3 = page_alloc(4);
-	printf("p3 = 0x%x\n", p3);
+	printf("p3 = %p\n", p3);
 }
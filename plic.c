@@ -0,0 +1,106 @@
+#include "os.h"
+
+/*
+ * handlers of interrupt sources, registered by drivers with plic_register()
+ */
+static void (*_handlers[PLIC_NR_IRQS])(void);
+
+/**
+ * @brief plic_init lets all harts accept interrupts of any priority > 0, called once by hart 0
+ *        before any driver registers its interrupt
+ */
+void plic_init(void) {
+    for (int hart = 0; hart < MAXNUM_CPU; hart++)
+        plic_set_threshold(hart, 0);
+}
+
+/**
+ * @brief plic_set_priority sets priority of an interrupt source
+ * 
+ * @param irq interrupt source
+ * @param priority 0 means never interrupt, the higher the more urgent
+ */
+void plic_set_priority(int irq, int priority) {
+    *(volatile uint32_t *)PLIC_PRIORITY(irq) = priority;
+}
+
+/**
+ * @brief plic_set_threshold masks interrupts with priority <= threshold on a hart
+ * 
+ * @param hart hart id
+ * @param threshold 0 accepts interrupts of any priority > 0
+ */
+void plic_set_threshold(int hart, int threshold) {
+    *(volatile uint32_t *)PLIC_MTHRESHOLD(hart) = threshold;
+}
+
+/**
+ * @brief plic_enable routes an interrupt source to a hart
+ * 
+ * @param hart hart id
+ * @param irq interrupt source
+ */
+void plic_enable(int hart, int irq) {
+    volatile uint32_t *enable = (volatile uint32_t *)PLIC_MENABLE(hart) + irq / 32;
+    *enable |= 1U << (irq % 32);
+}
+
+/**
+ * @brief plic_disable stops routing an interrupt source to a hart
+ * 
+ * @param hart hart id
+ * @param irq interrupt source
+ */
+void plic_disable(int hart, int irq) {
+    volatile uint32_t *enable = (volatile uint32_t *)PLIC_MENABLE(hart) + irq / 32;
+    *enable &= ~(1U << (irq % 32));
+}
+
+/**
+ * @brief plic_register sets the handler of an interrupt source, and routes it to a hart
+ *        with priority 1. The handler is called in interrupt context with interrupts disabled.
+ * 
+ * @param irq interrupt source
+ * @param handler handler of the interrupt
+ * @param hart hart which takes the interrupt
+ * @return int 0 if success, -1 if irq is invalid or already registered
+ */
+int plic_register(int irq, void (*handler)(void), int hart) {
+    if (irq <= 0 || irq >= PLIC_NR_IRQS || _handlers[irq] || hart < 0 || hart >= MAXNUM_CPU)
+        return -1;
+    _handlers[irq] = handler;
+    plic_set_priority(irq, 1);
+    plic_enable(hart, irq);
+    return 0;
+}
+
+/**
+ * @brief plic_claim claims the highest priority pending interrupt of current hart
+ * 
+ * @return int id of the interrupt, 0 if none
+ */
+int plic_claim(void) {
+    return *(volatile uint32_t *)PLIC_MCLAIM(r_tp());
+}
+
+/**
+ * @brief plic_complete tells PLIC the interrupt has been handled
+ * 
+ * @param irq id of the interrupt claimed
+ */
+void plic_complete(int irq) {
+    *(volatile uint32_t *)PLIC_MCOMPLETE(r_tp()) = irq;
+}
+
+/**
+ * @brief plic_dispatch calls the handler of an interrupt claimed
+ * 
+ * @param irq id of the interrupt claimed
+ * @return int 0 if handled, -1 if no handler is registered
+ */
+int plic_dispatch(int irq) {
+    if (irq <= 0 || irq >= PLIC_NR_IRQS || _handlers[irq] == NULL)
+        return -1;
+    _handlers[irq]();
+    return 0;
+}
@@ -1,136 +1,314 @@
 #include "os.h"
 
+/*
+ * Formatted chars are streamed into a sink in one pass, no matter where they go.
+ * The sink stages chars in its buffer, and calls flush when the buffer is full,
+ * so the length of output is not limited by the size of buffer. A sink without
+ * flush (e.g. the one of vsnprintf) just drops the chars that don't fit.
+ */
+
 /**
- * @brief _vsnprintf will replace format sign in s with value in vl and output to out
+ * @brief _sink_putc puts a char to sink
  * 
- * @param out buffer for replaced string, output string will be discard if set to NULL
- * @param n size of out
+ * @param sink sink to put
+ * @param c char to put
+ */
+static inline void _sink_putc(sink_t *sink, char c){
+    if (sink->pos >= sink->size) {
+        if (sink->flush == NULL) {
+            sink->total++;
+            return;
+        }
+        sink->flush(sink);
+        sink->pos = 0;
+    }
+    sink->buf[sink->pos++] = c;
+    sink->total++;
+}
+
+static inline void _sink_pad(sink_t *sink, char c, int n){
+    while (n-- > 0)
+        _sink_putc(sink, c);
+}
+
+/*
+ * "00" "01" ... "99", converting two decimal digits at a time halves the divisions
+ */
+static const char _digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/**
+ * @brief _utoa10 converts num to decimal digits, from the end of buf backwards
+ * 
+ * @param num number to convert
+ * @param end end of buffer, at least 10 chars before it
+ * @return char* the first digit
+ */
+static char *_utoa10(uint32_t num, char *end){
+    char *p = end;
+    while (num >= 100) {
+        // num / 100 without division: 0x51EB851F / 2^37 is 1/100 rounded up, exact for 32 bits num
+        uint32_t q = (uint32_t)(((uint64_t)num * 0x51EB851FU) >> 37);
+        uint32_t r = num - q * 100;
+        *--p = _digit_pairs[2 * r + 1];
+        *--p = _digit_pairs[2 * r];
+        num = q;
+    }
+    if (num >= 10) {
+        *--p = _digit_pairs[2 * num + 1];
+        *--p = _digit_pairs[2 * num];
+    } else {
+        *--p = '0' + num;
+    }
+    return p;
+}
+
+/**
+ * @brief _utoa16 converts num to hexadecimal digits, from the end of buf backwards
+ * 
+ * @param num number to convert
+ * @param end end of buffer, at least 8 chars before it
+ * @param ndigits minimum number of digits
+ * @return char* the first digit
+ */
+static char *_utoa16(uint32_t num, char *end, int ndigits){
+    char *p = end;
+    do {
+        int d = num & 0x0F;
+        *--p = d < 10 ? '0' + d : 'a' + d - 10;
+        num >>= 4;
+    } while (num || end - p < ndigits);
+    return p;
+}
+
+/**
+ * @brief _vformat replaces format sign in s with value in vl and streams the output to sink
+ *        supports %[-][0][width][l]{d,i,u,x,p,s,c,%}
+ * 
+ * @param sink where the output goes
  * @param s format string
  * @param vl value list
- * @return int length of out
+ * @return int length of output
  */
-static int _vsnprintf(char *out, size_t n, const char *s, va_list vl){
-    int format = 0;
-    // longarg is used for mark with 'l', e.g., 'ld', 
-    int longarg = 0;
-    size_t pos = 0;
-    // loop to process string with format marks
+static int _vformat(sink_t *sink, const char *s, va_list vl){
+    char digits[12];
+    char *end = digits + sizeof(digits);
+
     for (; *s; s++){
-        // format will be set to 1 if last char is '%'
-        if (format){
-            switch (*s){
-                case 'l': {
-                    longarg = 1;
-                    break;
-                }
-                case 'p': {
-                    longarg = 1;
-                    if (out && pos < n)
-                        out[pos] = '0';
-                    pos++;
-                    if (out && pos < n)
-                        out[pos] = 'x';
-                    pos++;
-                }
-                case 'x': {
-                    long num = longarg ? va_arg(vl, long) : va_arg(vl, int);
-                    int hexdigits = 2 * (longarg ? sizeof(long) : sizeof(int)) - 1;
-                    for (int i = hexdigits; i>= 0; i--) {
-                        // get each digits
-                        int d = (num >> (4 * i)) & 0x0F;
-                        //  convert to ascii
-                        if (out && pos < n)
-                            out[pos] = (d < 10 ? '0' + d : 'a' + d - 10);
-                        pos++;
-                    }
-                    longarg = 0;
-                    format = 0;
-                    break;
-                }
-                case 'd': {
-                    // 
-                    long num = longarg ? va_arg(vl, long) : va_arg(vl, int);
-                    // process negative integer, print a minus sign and absolute value
-                    if (num < 0){
-                        num = -num;
-                        if (out && pos < n)
-                            out[pos] = '-';
-                        pos++;
-                    }
-                    // print each digits, start from highest digit
-                    long digits = 1;
-                    for (long nn = num; nn /= 10; digits++);
-                    for (int i = digits - 1; i >= 0; i--){
-                        if (out && pos + i < n)
-                            out[pos + i] = '0' + (num % 10);
-                        num /= 10;
-                    }
-                    pos += digits;
-                    longarg = 0;
-                    format = 0;
-                    break;
-                }
-                case 's': {
-                    const char *s2 = va_arg(vl, const char*);
-                    while (*s2){
-                        if (out && pos < n)
-                            out[pos] = *s2;
-                        pos++;
-                        s2++;
-                    }
-                    longarg = 0;
-                    format = 0;
-                    break;
-                }
-                case 'c': {
-                    if (out && pos < n)
-                        out[pos] = (char) va_arg(vl, int);
-                    pos++;
-                    longarg = 0;
-                    format = 0;
-                    break;
-                }
-                default:
-                    break;
-            }
-        } else if (*s == '%') {
-            format = 1;
-        } else {
+        if (*s != '%') {
             // just copy if is not format string
-            if (out && pos < n)
-                out[pos] = *s;
-            pos++;
+            _sink_putc(sink, *s);
+            continue;
+        }
+
+        // parse flags and width
+        int left = 0, zero = 0, width = 0;
+        for (s++; *s == '-' || *s == '0'; s++) {
+            if (*s == '-')
+                left = 1;
+            else
+                zero = 1;
+        }
+        for (; *s >= '0' && *s <= '9'; s++)
+            width = width * 10 + (*s - '0');
+        // longarg is used for mark with 'l', e.g., 'ld'
+        int longarg = 0;
+        while (*s == 'l') {
+            longarg = 1;
+            s++;
         }
+
+        const char *str = NULL;
+        int len = 0;
+        int neg = 0;
+        switch (*s){
+            case 'd':
+            case 'i': {
+                long num = longarg ? va_arg(vl, long) : va_arg(vl, int);
+                // process negative integer, print a minus sign and absolute value
+                uint32_t abs = num < 0 ? 0U - (uint32_t)num : (uint32_t)num;
+                neg = num < 0;
+                str = _utoa10(abs, end);
+                len = end - str;
+                break;
+            }
+            case 'u':
+                str = _utoa10(longarg ? va_arg(vl, unsigned long) : va_arg(vl, unsigned int), end);
+                len = end - str;
+                break;
+            case 'x':
+                str = _utoa16(longarg ? va_arg(vl, unsigned long) : va_arg(vl, unsigned int), end, 1);
+                len = end - str;
+                break;
+            case 'p':
+                // pointers are always printed with all digits
+                _sink_putc(sink, '0');
+                _sink_putc(sink, 'x');
+                str = _utoa16((uint32_t)va_arg(vl, void *), end, 2 * sizeof(void *));
+                len = end - str;
+                width -= 2;
+                break;
+            case 's':
+                str = va_arg(vl, const char *);
+                if (str == NULL)
+                    str = "(null)";
+                for (len = 0; str[len]; len++);
+                zero = 0;
+                break;
+            case 'c':
+                digits[0] = (char)va_arg(vl, int);
+                str = digits;
+                len = 1;
+                zero = 0;
+                break;
+            case '%':
+                _sink_putc(sink, '%');
+                continue;
+            case '\0':
+                // format string ends with '%'
+                s--;
+                continue;
+            default:
+                continue;
+        }
+
+        int pad = width - len - neg;
+        if (!left && !zero)
+            _sink_pad(sink, ' ', pad);
+        if (neg)
+            _sink_putc(sink, '-');
+        if (!left && zero)
+            _sink_pad(sink, '0', pad);
+        for (int i = 0; i < len; i++)
+            _sink_putc(sink, str[i]);
+        if (left)
+            _sink_pad(sink, ' ', pad);
     }
+    return sink->total;
+}
 
-    if (out && pos < n)
-        out[pos] = 0;
-    else if (out && n)
-        out[n - 1] = 0;
+/**
+ * @brief vsink_printf formats string and streams it to sink, then flushes the sink
+ * 
+ * @param sink where the output goes
+ * @param s format string
+ * @param vl value list
+ * @return int length of output
+ */
+int vsink_printf(sink_t *sink, const char *s, va_list vl){
+    int res = _vformat(sink, s, vl);
+    if (sink->flush && sink->pos) {
+        sink->flush(sink);
+        sink->pos = 0;
+    }
+    return res;
+}
+
+/**
+ * @brief sink_printf formats string and streams it to sink
+ * 
+ * @param sink where the output goes
+ * @param s format string
+ * @param ... value list
+ * @return int length of output
+ */
+int sink_printf(sink_t *sink, const char *s, ...){
+    va_list vl;
+    va_start(vl, s);
+    int res = vsink_printf(sink, s, vl);
+    va_end(vl);
+    return res;
+}
+
+/**
+ * @brief vsnprintf formats string to out, the output is truncated if out is too small
+ * 
+ * @param out buffer for formatted string, always null-terminated if n > 0
+ * @param n size of out
+ * @param s format string
+ * @param vl value list
+ * @return int length of the whole output, not including the terminating null
+ */
+int vsnprintf(char *out, size_t n, const char *s, va_list vl){
+    sink_t sink = {
+        .buf = out,
+        .size = n ? n - 1 : 0,
+        .pos = 0,
+        .total = 0,
+        .flush = NULL,
+    };
+    int res = _vformat(&sink, s, vl);
+    if (n)
+        out[sink.pos] = 0;
+    return res;
+}
 
-    return pos;
+/**
+ * @brief snprintf formats string to out, the output is truncated if out is too small
+ * 
+ * @param out buffer for formatted string, always null-terminated if n > 0
+ * @param n size of out
+ * @param s format string
+ * @param ... value list
+ * @return int length of the whole output, not including the terminating null
+ */
+int snprintf(char *out, size_t n, const char *s, ...){
+    va_list vl;
+    va_start(vl, s);
+    int res = vsnprintf(out, n, s, vl);
+    va_end(vl);
+    return res;
 }
 
+/*
+ * Console sink stages chars in a small buffer on the stack of the caller, and
+ * sends them to UART ring buffer a chunk at a time.
+ * _print_lock keeps output of one printf() from being mixed with others. It is
+ * a ticket lock, so that a hart printing a lot can not starve the others.
+ */
+#define CONSOLE_CHUNK 64
+
+static ticketlock_t _print_lock;
 
-// buffer for _vprintf()
-static char out_buf[1000];
+void printf_init(){
+    ticket_init(&_print_lock, "printf");
+}
+
+static void _console_flush(sink_t *sink){
+    uart_write(sink->buf, sink->pos);
+}
 
 /**
- * @brief _vprintf replace format sign in s with values in vl
+ * @brief _vprintf replace format sign in s with values in vl and prints it
  * 
  * @param s format string
  * @param vl value list
- * @return int length of s
+ * @return int length of output
  */
 static int _vprintf(const char *s, va_list vl){
-    // check length
-    int res = _vsnprintf(NULL, -1, s, vl);
-    if (res + 1 >= sizeof(out_buf)){
-        uart_puts("error: output string size overflow\n");
-        while (1);
-    }
-    _vsnprintf(out_buf, res + 1, s, vl);
-    uart_puts(out_buf);
+    char buf[CONSOLE_CHUNK];
+    sink_t sink = {
+        .buf = buf,
+        .size = sizeof(buf),
+        .pos = 0,
+        .total = 0,
+        .flush = _console_flush,
+    };
+    reg_t flags = ticket_lock_irqsave(&_print_lock);
+    int res = vsink_printf(&sink, s, vl);
+    ticket_unlock_irqrestore(&_print_lock, flags);
+    // nobody will drain the ring buffer if interrupts are off, send it by ourselves
+    if (!flags)
+        uart_flush();
     return res;
 }
 
@@ -156,8 +334,13 @@ int printf(const char*s, ...){
  * @param s panic message
  */
 void panic(char *s){
+    irq_save();
+    // we may panic while printing, don't wait for ourselves
+    if (ticket_holding(&_print_lock))
+        ticket_unlock(&_print_lock);
     printf("panic: ");
     printf(s);
     printf("\n");
+    uart_flush();
     while (1);
-}
\ No newline at end of file
+}
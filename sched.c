@@ -1,47 +1,719 @@
 #include "os.h"
 
 // defined in entry.S
-extern void switch_to(context_t *next);
+extern void switch_to(context_t *prev, context_t *next);
+extern void switch_context(context_t *prev, context_t *next);
 
-#define STACK_SIZE 1024
+// defined in timer.c
+extern void timer_idle_enter(void);
+extern void timer_idle_exit(void);
 
-uint8_t task_stack[STACK_SIZE];
-context_t ctx_task;
+// each task has one page of stack
+#define STACK_PAGES 1
+
+/*
+ * states of task
+ */
+#define TASK_READY   0
+#define TASK_RUNNING 1
+#define TASK_EXITED  2
+#define TASK_BLOCKED 3
+
+/**
+ * @brief task control block
+ */
+typedef struct task {
+    context_t ctx;
+    int id;
+    int state;
+    uint8_t priority;
+    uint32_t affinity;
+    timer_t timer;              // wakes the task up from task_sleep_us()
+    uint8_t *stack;
+    struct task *next;          // in inbox or zombie list
+    struct task *wait_next;     // in a wait queue
+} task_t;
+
+// must be a power of 2
+#define DEQUE_SIZE 32
+
+/**
+ * @brief deque of ready tasks of one priority, in Chase-Lev style
+ * 
+ *  Only the owner hart pushes at bottom, while both the owner and thieves
+ *  take from top with a CAS, so tasks of the same priority still run in
+ *  FIFO order on the owner. top and bottom only grow, and wrap around the
+ *  buffer by DEQUE_SIZE.
+ */
+struct deque {
+    volatile uint32_t top;
+    volatile uint32_t bottom;
+    task_t *volatile buf[DEQUE_SIZE];
+};
+
+/**
+ * @brief run queue of a hart
+ * 
+ *  Bit i of bitmap is set if the deque of priority i may be not empty. It
+ *  is only written by the owner, thieves may read it as a hint. nr_ready
+ *  counts tasks in the deques, so that an idle hart can find the busiest
+ *  peer without walking its deques.
+ * 
+ *  Other harts can not push to our deques, they put tasks to the inbox
+ *  instead, which is protected by a lock and moved to the deques by the
+ *  owner in _pick_next(). Tasks overflowing a full deque go there too.
+ */
+struct runqueue {
+    uint32_t bitmap;
+    volatile int nr_ready;
+    struct deque level[PRIO_LEVELS];
+
+    spinlock_t inbox_lock;
+    task_t *inbox_head;
+    task_t *inbox_tail;
+    volatile int nr_inbox;
+};
+
+/*
+ * Each hart has its own run queue, and only touches its own per-hart data
+ * with interrupts disabled.
+ *  - _current[hartid]: the task running on the hart
+ *  - _idle[hartid]: the idle task of the hart, never put to run queue
+ *  - _zombie[hartid]: exited tasks of the hart, to be freed once we are off their stacks
+ */
+static struct runqueue _rq[MAXNUM_CPU];
+static task_t *_current[MAXNUM_CPU];
+static task_t *_idle[MAXNUM_CPU];
+static task_t *_zombie[MAXNUM_CPU];
+
+static kmem_cache_t *_task_cache = NULL;
+static int _next_id = 0;
+
+// bit i is set while hart i is sleeping in wfi
+static volatile uint32_t _idle_mask = 0;
+
+static inline int _busy(task_t *task) {
+    return *(volatile reg_t *)&task->ctx.busy;
+}
 
 /**
- * @brief w_mscratch write mscratch register to x
+ * @brief _deque_push pushes a task at bottom, called by the owner only
  * 
- * @param x value set to mscratch register
+ * @return int 0 if success, -1 if the deque is full
  */
-static void w_mscratch(reg_t x){
-    asm volatile (
-        "csrw mscratch, %0"
-        :
-        : "r"(x)
-    );
+static int _deque_push(struct deque *dq, task_t *task) {
+    uint32_t b = dq->bottom;
+    // top only grows, so a stale top makes us see less space, never more
+    if (b - dq->top >= DEQUE_SIZE)
+        return -1;
+    dq->buf[b & (DEQUE_SIZE - 1)] = task;
+    // the slot must be visible before thieves see the new bottom
+    __sync_synchronize();
+    dq->bottom = b + 1;
+    return 0;
 }
 
-void user_task0(void);
+/**
+ * @brief _stealable checks if a thief may take the task, i.e. it is not busy on the
+ *        owner and allowed to run on the thief
+ */
+static inline int _stealable(task_t *task, int thief) {
+    return !_busy(task) && (task->affinity & (1U << thief));
+}
+
+/**
+ * @brief _deque_take takes a task from top, called by both the owner and thieves
+ * 
+ * @param thief id of the stealing hart, -1 for the owner. Thieves leave tasks
+ *        which are still busy on the owner or not allowed to run on them.
+ * @return task_t* the task, NULL if there is nothing to take
+ */
+static task_t *_deque_take(struct deque *dq, int thief) {
+    while (1) {
+        uint32_t t = dq->top;
+        __sync_synchronize();
+        if ((int)(dq->bottom - t) <= 0)
+            return NULL;
+        // the slot may be overwritten once top moves on, then the CAS below fails
+        task_t *task = dq->buf[t & (DEQUE_SIZE - 1)];
+        if (thief >= 0 && !_stealable(task, thief))
+            return NULL;
+        if (__sync_bool_compare_and_swap(&dq->top, t, t + 1))
+            return task;
+    }
+}
+
+/**
+ * @brief _deque_peek checks if a thief could take the task at top, without taking it
+ */
+static int _deque_peek(struct deque *dq, int thief) {
+    uint32_t t = dq->top;
+    __sync_synchronize();
+    if ((int)(dq->bottom - t) <= 0)
+        return 0;
+    return _stealable(dq->buf[t & (DEQUE_SIZE - 1)], thief);
+}
+
+/**
+ * @brief _rq_push puts a ready task to the run queue of current hart
+ */
+static void _rq_push(int id, task_t *task) {
+    struct runqueue *rq = &_rq[id];
+    uint8_t prio = task->priority;
+
+    rq->bitmap |= 1U << prio;
+    if (_deque_push(&rq->level[prio], task) == 0) {
+        __sync_fetch_and_add(&rq->nr_ready, 1);
+        return;
+    }
+
+    // deque is full, park the task in our own inbox
+    task->next = NULL;
+    spin_lock(&rq->inbox_lock);
+    if (rq->inbox_tail)
+        rq->inbox_tail->next = task;
+    else
+        rq->inbox_head = task;
+    rq->inbox_tail = task;
+    rq->nr_inbox++;
+    spin_unlock(&rq->inbox_lock);
+}
+
+/**
+ * @brief _rq_push_remote puts a ready task to the inbox of another hart, and
+ *        kicks it with an IPI to pick the task up
+ */
+static void _rq_push_remote(int id, task_t *task) {
+    struct runqueue *rq = &_rq[id];
+
+    task->next = NULL;
+    reg_t flags = spin_lock_irqsave(&rq->inbox_lock);
+    if (rq->inbox_tail)
+        rq->inbox_tail->next = task;
+    else
+        rq->inbox_head = task;
+    rq->inbox_tail = task;
+    rq->nr_inbox++;
+    spin_unlock_irqrestore(&rq->inbox_lock, flags);
+
+    *(volatile uint32_t *)CLINT_MSIP(id) = 1;
+}
+
+/**
+ * @brief _rq_drain_inbox moves tasks in the inbox of current hart to its deques,
+ *        as long as they have room
+ */
+static void _rq_drain_inbox(int id) {
+    struct runqueue *rq = &_rq[id];
+    if (rq->nr_inbox == 0)
+        return;
+
+    spin_lock(&rq->inbox_lock);
+    task_t **pp = &rq->inbox_head;
+    rq->inbox_tail = NULL;
+    while (*pp) {
+        task_t *task = *pp;
+        uint8_t prio = task->priority;
+        rq->bitmap |= 1U << prio;
+        if (_deque_push(&rq->level[prio], task) == 0) {
+            __sync_fetch_and_add(&rq->nr_ready, 1);
+            *pp = task->next;
+            task->next = NULL;
+            rq->nr_inbox--;
+        } else {
+            rq->inbox_tail = task;
+            pp = &task->next;
+        }
+    }
+    spin_unlock(&rq->inbox_lock);
+}
+
+/**
+ * @brief _rq_pop takes the ready task with the highest priority of current hart
+ */
+static task_t *_rq_pop(int id) {
+    struct runqueue *rq = &_rq[id];
+    while (rq->bitmap) {
+        int prio = ctz32(rq->bitmap);
+        task_t *task = _deque_take(&rq->level[prio], -1);
+        if (task) {
+            __sync_fetch_and_sub(&rq->nr_ready, 1);
+            return task;
+        }
+        rq->bitmap &= ~(1U << prio);
+    }
+    return NULL;
+}
+
+/**
+ * @brief _steal_from takes a ready task from the given peer, only the task at top of
+ *        each priority is looked at
+ */
+static task_t *_steal_from(int victim, int id) {
+    struct runqueue *rq = &_rq[victim];
+    uint32_t bitmap = rq->bitmap;
+    while (bitmap) {
+        int prio = ctz32(bitmap);
+        task_t *task = _deque_take(&rq->level[prio], id);
+        if (task) {
+            __sync_fetch_and_sub(&rq->nr_ready, 1);
+            TRACE(TRACE_STEAL, victim, task->id, 0);
+            return task;
+        }
+        bitmap &= ~(1U << prio);
+    }
+    return NULL;
+}
+
+/**
+ * @brief _can_steal_from checks if _steal_from() would find a task on the given peer
+ */
+static int _can_steal_from(int victim, int id) {
+    struct runqueue *rq = &_rq[victim];
+    uint32_t bitmap = rq->bitmap;
+    while (bitmap) {
+        int prio = ctz32(bitmap);
+        if (_deque_peek(&rq->level[prio], id))
+            return 1;
+        bitmap &= ~(1U << prio);
+    }
+    return 0;
+}
+
+/**
+ * @brief _steal takes a ready task from the busiest peer of current hart. If all
+ *        tasks there are pinned or busy, the other peers are tried too.
+ */
+static task_t *_steal(int id) {
+    int victim = -1;
+    int most = 0;
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        int n = _rq[i].nr_ready;
+        if (i != id && n > most) {
+            most = n;
+            victim = i;
+        }
+    }
+    if (victim < 0)
+        return NULL;
+
+    task_t *task = _steal_from(victim, id);
+    for (int i = 0; task == NULL && i < MAXNUM_CPU; i++) {
+        if (i != id && i != victim && _rq[i].nr_ready)
+            task = _steal_from(i, id);
+    }
+    return task;
+}
+
+/**
+ * @brief _kick_idle wakes up an idle hart other than current one with an IPI, so that it
+ *        can steal the task we just made ready
+ */
+static void _kick_idle(int id) {
+    uint32_t idle = _idle_mask & ~(1U << id);
+    if (idle)
+        *(volatile uint32_t *)CLINT_MSIP(ctz32(idle)) = 1;
+}
+
+/**
+ * @brief _work_available checks if there is any task current hart may pick up. Tasks
+ *        of peers only count if _steal() could take them, so that work pinned to other
+ *        harts, or still switching out there, does not keep us out of wfi.
+ */
+static int _work_available(int id) {
+    if (_rq[id].nr_inbox || _rq[id].nr_ready)
+        return 1;
+    for (int i = 0; i < MAXNUM_CPU; i++) {
+        if (i != id && _rq[i].nr_ready && _can_steal_from(i, id))
+            return 1;
+    }
+    return 0;
+}
+
+static void _task_wakeup(void *param);
+
+/**
+ * @brief _task_alloc allocates a task control block and its stack
+ * 
+ * @param start_routine entry of the task
+ * @param param parameter passed to start_routine
+ * @param priority priority of the task
+ * @return task_t* the task, NULL if out of memory
+ */
+static task_t *_task_alloc(void (*start_routine)(void *param), void *param, uint8_t priority) {
+    task_t *task = (task_t *)kmem_cache_alloc(_task_cache);
+    if (task == NULL)
+        return NULL;
+    task->stack = (uint8_t *)page_alloc(STACK_PAGES);
+    if (task->stack == NULL) {
+        kmem_cache_free(_task_cache, task);
+        return NULL;
+    }
+
+    reg_t *regs = (reg_t *)&task->ctx;
+    for (int i = 0; i < sizeof(context_t) / sizeof(reg_t); i++)
+        regs[i] = 0;
+    task->ctx.sp = (reg_t)(task->stack + STACK_PAGES * PAGE_SIZE);
+    task->ctx.pc = (reg_t)start_routine;
+    task->ctx.a0 = (reg_t)param;
+    // returning from start_routine exits the task
+    task->ctx.ra = (reg_t)task_exit;
+
+    task->id = __sync_fetch_and_add(&_next_id, 1);
+    task->state = TASK_READY;
+    task->priority = priority;
+    task->affinity = HART_MASK_ALL;
+    timer_setup(&task->timer, _task_wakeup, task);
+    task->next = NULL;
+    task->wait_next = NULL;
+    return task;
+}
+
+static void _task_free(task_t *task) {
+    page_free(task->stack);
+    kmem_cache_free(_task_cache, task);
+}
+
+/**
+ * @brief _reap frees exited tasks of current hart, except the one we are still running on
+ */
+static void _reap(int id) {
+    task_t **pp = &_zombie[id];
+    while (*pp) {
+        task_t *task = *pp;
+        if (task == _current[id]) {
+            pp = &task->next;
+            continue;
+        }
+        *pp = task->next;
+        _task_free(task);
+    }
+}
+
+/*
+ * idle task of each hart. It sleeps in wfi with only the next timer event programmed,
+ * and wakes up on timer, external and software interrupts, e.g. the IPI sent by a hart
+ * which has a new task to steal.
+ */
+static void _idle_task(void *param) {
+    while (1) {
+        // nothing else to do, zero a page for page_alloc_zeroed(). One page at a time,
+        // so that a task made ready meanwhile waits for one page at most
+        if (page_zero_refill()) {
+            task_yield();
+            continue;
+        }
+
+        reg_t flags = irq_save();
+        int id = r_tp();
+        uint32_t bit = 1U << id;
+
+        // announce we are idle before looking for work, so that a task made ready after
+        // the check kicks us out of wfi
+        __sync_fetch_and_or(&_idle_mask, bit);
+        if (!_work_available(id)) {
+            timer_idle_enter();
+            wfi();
+            timer_idle_exit();
+        }
+        __sync_fetch_and_and(&_idle_mask, ~bit);
+
+        // pending interrupts are taken here
+        irq_restore(flags);
+        task_yield();
+    }
+}
+
+/**
+ * @brief sched_init initializes the scheduler, called once by hart 0
+ */
 void sched_init() {
+    _task_cache = kmem_cache_create("task", sizeof(task_t), 0);
+    if (_task_cache == NULL)
+        panic("sched_init: failed to create task cache");
+    for (int i = 0; i < MAXNUM_CPU; i++)
+        spin_init(&_rq[i].inbox_lock, "inbox");
+}
+
+/**
+ * @brief sched_init_hart initializes the scheduler of current hart
+ */
+void sched_init_hart() {
+    int id = r_tp();
     w_mscratch(0);
-    ctx_task.sp = (reg_t) &task_stack[STACK_SIZE];
-    ctx_task.ra = (reg_t) user_task0;
+    _current[id] = NULL;
+    _idle[id] = _task_alloc(_idle_task, NULL, PRIO_LEVELS - 1);
+    if (_idle[id] == NULL)
+        panic("sched_init_hart: failed to create idle task");
+}
+
+/**
+ * @brief _pick_next puts the current task back to run queue if it is still runnable,
+ *        and picks the ready task with the highest priority to run next. If current
+ *        hart has nothing to run, it steals a task from the busiest peer.
+ *        Must be called with interrupts disabled.
+ * 
+ * @param id id of current hart
+ * @return task_t* the next task, which has been set as current
+ */
+static task_t *_pick_next(int id) {
+    task_t *prev = _current[id];
+
+    _reap(id);
+
+    if (prev && prev != _idle[id] && prev->state == TASK_RUNNING) {
+        prev->state = TASK_READY;
+        _rq_push(id, prev);
+    }
+
+    _rq_drain_inbox(id);
+    task_t *next = _rq_pop(id);
+    if (next == NULL)
+        next = _steal(id);
+    if (next == NULL)
+        next = _idle[id];
+
+    // a task handed over by another hart may still be switching out there
+    if (next != prev) {
+        while (_busy(next));
+        __sync_synchronize();
+    }
+    next->ctx.busy = 1;
+    next->state = TASK_RUNNING;
+    _current[id] = next;
+    if (next != prev)
+        TRACE(TRACE_SWITCH, prev ? prev->id : -1, next->id, next == _idle[id]);
+    return next;
 }
 
+/**
+ * @brief schedule switches to the next task, called on interrupts.
+ *        Must be called with interrupts disabled, and context of the current task (if any)
+ *        must have been saved by trap_vector.
+ */
 void schedule() {
-    context_t *next = &ctx_task;
-    switch_to(next);
+    int id = r_tp();
+    task_t *prev = _current[id];
+    task_t *next = _pick_next(id);
+    switch_to(prev ? &prev->ctx : NULL, &next->ctx);
 }
 
-void task_delay(volatile int count) {
-    count *= 50000;
-    while (count--);
+/**
+ * @brief task_create creates a task which may run on any hart
+ * 
+ * @param start_routine entry of the task
+ * @param param parameter passed to start_routine
+ * @param priority priority of the task, 0 is the highest, must be less than PRIO_LEVELS - 1
+ * @return int id of the task, -1 if failed
+ */
+int task_create(void (*start_routine)(void *param), void *param, uint8_t priority) {
+    return task_create_affinity(start_routine, param, priority, HART_MASK_ALL);
 }
 
-void user_task0(void){
-    uart_puts("Task 0: Created!\n");
-    while (1) {
-        uart_puts("Task 0: Running...\n");
-        task_delay(1000);
+/**
+ * @brief task_create_affinity creates a task which only runs on given harts. The task
+ *        is put to current hart if allowed, otherwise to the first allowed hart.
+ * 
+ * @param start_routine entry of the task
+ * @param param parameter passed to start_routine
+ * @param priority priority of the task, 0 is the highest, must be less than PRIO_LEVELS - 1
+ * @param affinity bit i is set if the task may run on hart i
+ * @return int id of the task, -1 if failed
+ */
+int task_create_affinity(void (*start_routine)(void *param), void *param, uint8_t priority, uint32_t affinity) {
+    affinity &= HART_MASK_ALL;
+    if (affinity == 0)
+        return -1;
+    if (priority >= PRIO_LEVELS - 1)
+        priority = PRIO_LEVELS - 2;
+
+    task_t *task = _task_alloc(start_routine, param, priority);
+    if (task == NULL)
+        return -1;
+    task->affinity = affinity;
+    int tid = task->id;
+
+    reg_t flags = irq_save();
+    int id = r_tp();
+    int local = affinity & (1U << id);
+    if (local) {
+        _rq_push(id, task);
+        _kick_idle(id);
+    } else
+        _rq_push_remote(ctz32(affinity), task);
+    task_t *cur = _current[id];
+    irq_restore(flags);
+
+    // run the new task right away if it is more important than us
+    if (local && cur && (cur == _idle[id] || priority < cur->priority))
+        task_yield();
+    return tid;
+}
+
+/**
+ * @brief task_set_affinity changes the harts current task may run on, and moves the
+ *        task to the first allowed hart if current hart is not allowed any more
+ * 
+ * @param affinity bit i is set if the task may run on hart i
+ * @return int 0 if success, -1 if affinity is empty
+ */
+int task_set_affinity(uint32_t affinity) {
+    affinity &= HART_MASK_ALL;
+    if (affinity == 0)
+        return -1;
+
+    reg_t flags = irq_save();
+    int id = r_tp();
+    task_t *task = _current[id];
+    task->affinity = affinity;
+    if (!(affinity & (1U << id))) {
+        // the other hart waits for us to switch out before running the task
+        task->state = TASK_READY;
+        _rq_push_remote(ctz32(affinity), task);
+        task_t *next = _pick_next(id);
+        switch_context(&task->ctx, &next->ctx);
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+/**
+ * @brief task_yield gives up the rest of time slice of current task
+ */
+void task_yield() {
+    reg_t flags = irq_save();
+    int id = r_tp();
+    task_t *prev = _current[id];
+    task_t *next = _pick_next(id);
+    // only callee-saved registers need to be saved when we give up CPU voluntarily
+    if (next != prev)
+        switch_context(&prev->ctx, &next->ctx);
+    irq_restore(flags);
+}
+
+/**
+ * @brief task_exit terminates current task, called when the task returns from its entry
+ */
+void task_exit() {
+    irq_save();
+    int id = r_tp();
+    task_t *task = _current[id];
+    task->state = TASK_EXITED;
+    task->next = _zombie[id];
+    _zombie[id] = task;
+    // nothing to save for an exited task, its stack will be freed by next _pick_next()
+    task_t *next = _pick_next(id);
+    switch_to(&task->ctx, &next->ctx);
+}
+
+/**
+ * @brief _task_wakeup makes a blocked task ready again, and puts it to current hart if
+ *        allowed. Must be called with interrupts disabled.
+ * 
+ * @param param the task to wake up
+ */
+static void _task_wakeup(void *param) {
+    task_t *task = (task_t *)param;
+    // the task may be woken up by more than one source
+    if (!__sync_bool_compare_and_swap(&task->state, TASK_BLOCKED, TASK_READY))
+        return;
+
+    int id = r_tp();
+    if (task->affinity & (1U << id)) {
+        TRACE(TRACE_WAKEUP, task->id, id, 0);
+        _rq_push(id, task);
+        _kick_idle(id);
+    } else {
+        TRACE(TRACE_WAKEUP, task->id, ctz32(task->affinity), 0);
+        _rq_push_remote(ctz32(task->affinity), task);
+    }
+}
+
+/**
+ * @brief task_sleep_us blocks current task for at least us microseconds, the hart runs
+ *        other tasks in the meantime
+ * 
+ * @param us microseconds to sleep
+ */
+void task_sleep_us(uint32_t us) {
+    reg_t flags = irq_save();
+    int id = r_tp();
+    task_t *task = _current[id];
+    if (task == _idle[id])
+        panic("task_sleep_us: idle task can not sleep");
+
+    // the timer can not fire before we switch out, since interrupts are disabled
+    task->state = TASK_BLOCKED;
+    timer_start(&task->timer, us, 0);
+    task_t *next = _pick_next(id);
+    switch_context(&task->ctx, &next->ctx);
+    irq_restore(flags);
+}
+
+/**
+ * @brief task_sleep_ms blocks current task for at least ms milliseconds
+ * 
+ * @param ms milliseconds to sleep
+ */
+void task_sleep_ms(uint32_t ms) {
+    // keep microseconds in 32 bits
+    while (ms > 1000000) {
+        task_sleep_us(1000000000);
+        ms -= 1000000;
     }
-}
\ No newline at end of file
+    task_sleep_us(ms * 1000);
+}
+
+/**
+ * @brief wait_sleep blocks current task on a wait queue until wait_wakeup(), like a condition
+ *        variable. lock protects both the condition the caller waits for and the queue, it must
+ *        be held by spin_lock_irqsave(). It is released while the task sleeps, and held again
+ *        on return, so callers check their condition in a loop:
+ *
+ *            reg_t flags = spin_lock_irqsave(&lock);
+ *            while (!cond)
+ *                wait_sleep(&wq, &lock);
+ *            spin_unlock_irqrestore(&lock, flags);
+ *
+ * @param wq wait queue to sleep on
+ * @param lock lock held by the caller
+ */
+void wait_sleep(wait_queue_t *wq, spinlock_t *lock) {
+    int id = r_tp();
+    task_t *task = _current[id];
+    if (task == _idle[id])
+        panic("wait_sleep: idle task can not sleep");
+
+    // a waker can not see us before lock is released, and can not wake us up twice,
+    // since it takes the task off the queue under lock
+    task->state = TASK_BLOCKED;
+    task->wait_next = NULL;
+    if (wq->tail)
+        wq->tail->wait_next = task;
+    else
+        wq->head = task;
+    wq->tail = task;
+    spin_unlock(lock);
+
+    task_t *next = _pick_next(id);
+    switch_context(&task->ctx, &next->ctx);
+    spin_lock(lock);
+}
+
+/**
+ * @brief wait_wakeup wakes up all tasks sleeping on a wait queue. Must be called holding
+ *        the lock the tasks passed to wait_sleep(), with interrupts disabled, which is
+ *        also the case in interrupt handlers.
+ *
+ * @param wq wait queue to wake up
+ */
+void wait_wakeup(wait_queue_t *wq) {
+    task_t *task = wq->head;
+    wq->head = wq->tail = NULL;
+    while (task) {
+        task_t *next = task->wait_next;
+        task->wait_next = NULL;
+        _task_wakeup(task);
+        task = next;
+    }
+}
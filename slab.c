@@ -0,0 +1,258 @@
+/**
+ * @file slab.c
+ * @author Jack Wang
+ * @brief A simple slab object allocator built on page_alloc().
+ *        Objects of the same size are carved out of one page slabs, so that small
+ *        objects no longer cost a whole page. kmalloc() is served by power-of-two
+ *        size classes from 16 B to 2 KB, larger requests fall back to page_alloc().
+ * @version 0.1
+ * @date 2023-04-16
+ * 
+ * @copyright Copyright (c) 2023
+ * 
+ */
+#include "os.h"
+
+/**
+ * @brief Slab Layout
+ * 
+ *      ,=======================,   <--- page aligned, found by masking the object address
+ *      |      struct slab      |
+ *      |-----------------------|   <--- cache->offset
+ *      |       object 0        |
+ *      |-----------------------|   <--- cache->offset + cache->size
+ *      |       object 1        |
+ *      |-----------------------|
+ *      |           .           |
+ *      |           .           |
+ *      |-----------------------|
+ *      |    object nobjs-1     |
+ *      |-----------------------|
+ *      |        unused         |
+ *      `======================='
+ * 
+ *  The first word of a free object points to the next free object of the slab.
+ */
+struct slab {
+    kmem_cache_t *cache;
+    struct slab *next;          // in the partial list of cache
+    struct slab *prev;
+    void *freelist;             // free objects of this slab
+    uint32_t inuse;             // number of allocated objects
+};
+
+struct kmem_cache {
+    spinlock_t lock;            // protects slabs of this cache
+    const char *name;
+    uint32_t size;              // object size, rounded up to align
+    uint32_t offset;            // offset of the first object in slab
+    uint32_t nobjs;             // number of objects per slab
+    struct slab *partial;       // slabs with at least one free object
+    uint32_t nslabs;            // number of slabs (pages) allocated
+};
+
+#define KMALLOC_MIN_ORDER 4     // 16 B
+#define KMALLOC_MAX_ORDER 11    // 2 KB
+#define KMALLOC_NR_CACHES (KMALLOC_MAX_ORDER - KMALLOC_MIN_ORDER + 1)
+
+static kmem_cache_t _kmalloc_caches[KMALLOC_NR_CACHES];
+static const char *_kmalloc_names[KMALLOC_NR_CACHES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k",
+};
+
+static inline uint32_t _align_up(uint32_t x, uint32_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static inline struct slab *_slab_of(void *obj)
+{
+    return (struct slab *)((uint32_t)obj & ~(PAGE_SIZE - 1));
+}
+
+static void _cache_init(kmem_cache_t *cache, const char *name, uint32_t size, uint32_t align)
+{
+    // at least a pointer is needed to link free objects
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    cache->name = name;
+    cache->size = _align_up(size, align);
+    cache->offset = _align_up(sizeof(struct slab), align);
+    cache->nobjs = (PAGE_SIZE - cache->offset) / cache->size;
+    cache->partial = NULL;
+    cache->nslabs = 0;
+    spin_init(&cache->lock, name);
+}
+
+static inline void _partial_add(kmem_cache_t *cache, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (slab->next)
+        slab->next->prev = slab;
+    cache->partial = slab;
+}
+
+static inline void _partial_del(kmem_cache_t *cache, struct slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/**
+ * @brief _slab_grow allocates a new slab for cache and puts it to the partial list
+ * 
+ * @param cache cache to grow
+ * @return struct slab* new slab, NULL if out of memory
+ */
+static struct slab *_slab_grow(kmem_cache_t *cache)
+{
+    struct slab *slab = (struct slab *)page_alloc(1);
+    if (slab == NULL)
+        return NULL;
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->freelist = NULL;
+    // link objects from the last one, so that the freelist starts from object 0
+    uint8_t *obj = (uint8_t *)slab + cache->offset + (cache->nobjs - 1) * cache->size;
+    for (int i = cache->nobjs - 1; i >= 0; i--) {
+        *(void **)obj = slab->freelist;
+        slab->freelist = obj;
+        obj -= cache->size;
+    }
+    _partial_add(cache, slab);
+    cache->nslabs++;
+    return slab;
+}
+
+/**
+ * @brief kmem_cache_create creates an object cache for objects of given size
+ * 
+ * @param name name of the cache, for debugging
+ * @param size size of object, must fit in a slab
+ * @param align alignment of object, must be power of 2, 0 means aligned to cache line
+ * @return kmem_cache_t* the cache, NULL if failed
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align)
+{
+    if (align == 0)
+        align = CACHE_LINE_SIZE;
+    if (size == 0 || _align_up(sizeof(struct slab), align) + _align_up(size, align) > PAGE_SIZE)
+        return NULL;
+
+    kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+    if (cache == NULL)
+        return NULL;
+    _cache_init(cache, name, size, align);
+    return cache;
+}
+
+/**
+ * @brief kmem_cache_alloc allocates an object from cache
+ * 
+ * @param cache cache to allocate from
+ * @return void* the object, NULL if out of memory
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    reg_t flags = spin_lock_irqsave(&cache->lock);
+    struct slab *slab = cache->partial;
+    if (slab == NULL && (slab = _slab_grow(cache)) == NULL) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return NULL;
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    slab->inuse++;
+    // the slab is full now, no more allocation from it
+    if (slab->freelist == NULL)
+        _partial_del(cache, slab);
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+/**
+ * @brief kmem_cache_free gives back an object to cache
+ * 
+ * @param cache cache the object allocated from
+ * @param obj object to free
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    struct slab *slab = _slab_of(obj);
+    reg_t flags = spin_lock_irqsave(&cache->lock);
+    if (slab->freelist == NULL)
+        _partial_add(cache, slab);
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+
+    // keep one empty slab for the next allocation, release the others
+    if (slab->inuse == 0 && (cache->partial != slab || slab->next != NULL)) {
+        _partial_del(cache, slab);
+        cache->nslabs--;
+    } else {
+        slab = NULL;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (slab)
+        page_free(slab);
+}
+
+void slab_init()
+{
+    for (int i = 0; i < KMALLOC_NR_CACHES; i++) {
+        uint32_t size = 1 << (i + KMALLOC_MIN_ORDER);
+        // objects of small size classes never cross cache lines as long as they are aligned to their size
+        uint32_t align = size < CACHE_LINE_SIZE ? size : CACHE_LINE_SIZE;
+        _cache_init(&_kmalloc_caches[i], _kmalloc_names[i], size, align);
+    }
+}
+
+/**
+ * @brief kmalloc allocates memory of given size
+ * 
+ * @param size bytes to allocate
+ * @return void* the memory, NULL if out of memory
+ */
+void *kmalloc(size_t size)
+{
+    if (size == 0)
+        return NULL;
+    if (size > (1 << KMALLOC_MAX_ORDER))
+        return page_alloc((size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    int i = 0;
+    while ((1 << (i + KMALLOC_MIN_ORDER)) < size)
+        i++;
+    return kmem_cache_alloc(&_kmalloc_caches[i]);
+}
+
+/**
+ * @brief kfree frees memory allocated by kmalloc
+ * 
+ * @param p memory to free
+ */
+void kfree(void *p)
+{
+    if (p == NULL)
+        return;
+    // slab objects are never page aligned, because the slab header sits at the start of page
+    if (((uint32_t)p & (PAGE_SIZE - 1)) == 0) {
+        page_free(p);
+        return;
+    }
+    struct slab *slab = _slab_of(p);
+    kmem_cache_free(slab->cache, p);
+}
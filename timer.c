@@ -0,0 +1,422 @@
+#include "os.h"
+
+extern void schedule(void);
+
+/*
+ * Default length of time slice, can be overwritten by QUANTUM_US in Makefile
+ * or timer_set_quantum() at runtime
+ */
+#ifndef CONFIG_QUANTUM_US
+#define CONFIG_QUANTUM_US 10000
+#endif
+
+#define TICKS_PER_US (CLINT_TIMEBASE_FREQ / 1000000)
+
+// time slice in mtime ticks
+static uint32_t _quantum = TICKS_PER_US * CONFIG_QUANTUM_US;
+
+/**
+ * @brief Hierarchical Timer Wheel
+ *
+ *  Each hart has a wheel of WHEEL_LEVELS levels, each level has WHEEL_SLOTS slots.
+ *  Time of the wheel is counted in wheel ticks, which are 2^WHEEL_SHIFT mtime ticks
+ *  (102.4 us at 10 MHz), so a timer fires at most one wheel tick late.
+ *
+ *      level 0: one slot per wheel tick,     timers expiring in [1, 64) ticks
+ *      level 1: one slot per 64 wheel ticks, timers expiring in [64, 64^2) ticks
+ *      level 2: ...                          timers expiring in [64^2, 64^3) ticks
+ *      level 3: ...                          timers expiring in [64^3, 64^4) ticks, or later
+ *
+ *  A timer is put to the slot indexed by its expiry tick at its level, so inserting and
+ *  canceling are O(1). When the wheel moves on, the slots it passes by are emptied: due
+ *  timers fire, and the others are put again to a lower level. Bit i of bitmap of a level
+ *  is set if slot i is not empty, so that empty slots cost nothing, and the next event
+ *  can be found without walking the slots.
+ */
+#define WHEEL_SHIFT 10
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_NEVER ((uint64_t)-1)
+
+struct wheel {
+    spinlock_t lock;
+    uint64_t now;                                   // in wheel ticks, timers up to now have fired
+    uint32_t bitmap[WHEEL_LEVELS][2];
+    struct timer_node slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct timer_node expired;                      // due timers waiting for their callbacks
+};
+
+static struct wheel _wheel[MAXNUM_CPU];
+
+// end of the time slice of each hart, in mtime ticks
+static uint64_t _slice_end[MAXNUM_CPU];
+
+// set while the hart is idle, there is no time slice to end then
+static int _tickless[MAXNUM_CPU];
+
+/**
+ * @brief _read_mtime reads 64 bits mtime with two 32 bits loads, retries if
+ *        the high word changes in between
+ *
+ * @return uint64_t value of mtime
+ */
+static uint64_t _read_mtime() {
+    volatile uint32_t *mtime = (volatile uint32_t *)CLINT_MTIME;
+    uint32_t hi, lo;
+    do {
+        hi = mtime[1];
+        lo = mtime[0];
+    } while (hi != mtime[1]);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * @brief _write_mtimecmp writes 64 bits mtimecmp of current hart with two 32 bits
+ *        stores, without raising a spurious interrupt in between
+ *
+ * @param value value set to mtimecmp
+ */
+static void _write_mtimecmp(uint64_t value) {
+    volatile uint32_t *mtimecmp = (volatile uint32_t *)CLINT_MTIMECMP(r_tp());
+    mtimecmp[1] = 0xFFFFFFFF;
+    mtimecmp[0] = (uint32_t)value;
+    mtimecmp[1] = (uint32_t)(value >> 32);
+}
+
+static inline void _node_init(struct timer_node *node) {
+    node->next = node;
+    node->prev = node;
+}
+
+static inline void _node_add(struct timer_node *head, struct timer_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static inline void _node_del(struct timer_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    _node_init(node);
+}
+
+// x >> (level * WHEEL_SLOT_BITS), without shifting 64 bits by a variable
+static inline uint64_t _level_shr(uint64_t x, int level) {
+    for (int i = 0; i < level; i++)
+        x >>= WHEEL_SLOT_BITS;
+    return x;
+}
+
+static inline uint64_t _level_shl(uint64_t x, int level) {
+    for (int i = 0; i < level; i++)
+        x <<= WHEEL_SLOT_BITS;
+    return x;
+}
+
+/**
+ * @brief _find_slot finds the first non-empty slot of a level, searching from slot
+ *        from and wrapping around
+ *
+ * @return int index of the slot, -1 if all slots are empty
+ */
+static int _find_slot(uint32_t *bitmap, int from) {
+    int word = from >> 5;
+    uint32_t bits = bitmap[word] & (~0U << (from & 31));
+    for (int i = 0; i < 3; i++) {
+        if (bits)
+            return (word << 5) + ctz32(bits);
+        word ^= 1;
+        bits = bitmap[word];
+    }
+    return -1;
+}
+
+/**
+ * @brief _wheel_add puts a timer to the wheel of hart id, must be called with the wheel locked
+ */
+static void _wheel_add(struct wheel *w, timer_t *t, int id) {
+    // round up, so that a timer never fires early
+    uint64_t tick = (t->expires + (1 << WHEEL_SHIFT) - 1) >> WHEEL_SHIFT;
+    if (tick <= w->now)
+        tick = w->now + 1;
+
+    uint64_t delta = tick - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && _level_shr(delta, level + 1) != 0)
+        level++;
+    // too far away, park it at the farthest slot, it will be put again when we get there
+    if (_level_shr(delta, level + 1) != 0)
+        tick = w->now + _level_shl(1, WHEEL_LEVELS) - 1;
+
+    int idx = _level_shr(tick, level) & (WHEEL_SLOTS - 1);
+    _node_add(&w->slot[level][idx], &t->node);
+    w->bitmap[level][idx >> 5] |= 1U << (idx & 31);
+    t->hart = id;
+}
+
+/**
+ * @brief _wheel_advance moves the wheel of hart id to tick, due timers are moved to
+ *        the expired list. Must be called with the wheel locked.
+ */
+static void _wheel_advance(struct wheel *w, uint64_t tick, int id) {
+    struct timer_node passed;
+    _node_init(&passed);
+
+    // empty all slots between now and tick of each level
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t from = _level_shr(w->now, level);
+        uint64_t to = _level_shr(tick, level);
+        uint64_t n = to - from + 1;
+        if (n > WHEEL_SLOTS)
+            n = WHEEL_SLOTS;
+        for (int i = 0; i < n; i++) {
+            int idx = (from + i) & (WHEEL_SLOTS - 1);
+            uint32_t bit = 1U << (idx & 31);
+            if (!(w->bitmap[level][idx >> 5] & bit))
+                continue;
+            w->bitmap[level][idx >> 5] &= ~bit;
+
+            struct timer_node *head = &w->slot[level][idx];
+            while (head->next != head) {
+                struct timer_node *node = head->next;
+                _node_del(node);
+                _node_add(&passed, node);
+            }
+        }
+    }
+
+    w->now = tick;
+    while (passed.next != &passed) {
+        timer_t *t = (timer_t *)passed.next;
+        _node_del(&t->node);
+        uint64_t due = (t->expires + (1 << WHEEL_SHIFT) - 1) >> WHEEL_SHIFT;
+        if (due <= tick)
+            _node_add(&w->expired, &t->node);
+        else
+            _wheel_add(w, t, id);
+    }
+}
+
+/**
+ * @brief _wheel_next finds the mtime when the wheel of a hart has to move on next time.
+ *        Must be called with the wheel locked.
+ *
+ * @return uint64_t mtime of next event, WHEEL_NEVER if there is no timer
+ */
+static uint64_t _wheel_next(struct wheel *w) {
+    if (w->expired.next != &w->expired)
+        return 0;
+
+    uint64_t next = WHEEL_NEVER;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t base = _level_shr(w->now, level);
+        int from = (base + 1) & (WHEEL_SLOTS - 1);
+        int idx = _find_slot(w->bitmap[level], from);
+        if (idx < 0)
+            continue;
+        // timers of the slot fire, or go to a lower level, when the wheel reaches it
+        uint64_t tick = _level_shl(base + 1 + ((idx - from) & (WHEEL_SLOTS - 1)), level);
+        if (tick < next)
+            next = tick;
+    }
+    return next == WHEEL_NEVER ? next : next << WHEEL_SHIFT;
+}
+
+/**
+ * @brief _program sets mtimecmp of current hart to the earlier one of the end of time slice
+ *        and the next timer event, or only the latter if the hart is idle. Must be called
+ *        with interrupts disabled.
+ */
+static void _program(int id) {
+    struct wheel *w = &_wheel[id];
+    spin_lock(&w->lock);
+    uint64_t next = _wheel_next(w);
+    spin_unlock(&w->lock);
+    if (!_tickless[id] && _slice_end[id] < next)
+        next = _slice_end[id];
+    _write_mtimecmp(next);
+}
+
+/**
+ * @brief _run_timers fires due timers of current hart, called in timer interrupt
+ *
+ * @return int number of timers fired
+ */
+static int _run_timers(int id, uint64_t now) {
+    struct wheel *w = &_wheel[id];
+    int fired = 0;
+
+    spin_lock(&w->lock);
+    uint64_t tick = now >> WHEEL_SHIFT;
+    if (tick > w->now)
+        _wheel_advance(w, tick, id);
+
+    while (w->expired.next != &w->expired) {
+        timer_t *t = (timer_t *)w->expired.next;
+        _node_del(&t->node);
+        t->hart = -1;
+        if (t->period) {
+            t->expires += t->period;
+            // skip the periods we missed
+            if (t->expires <= now)
+                t->expires = now + t->period;
+            _wheel_add(w, t, id);
+        }
+
+        // the callback may start or cancel timers
+        spin_unlock(&w->lock);
+        t->func(t->arg);
+        fired++;
+        spin_lock(&w->lock);
+    }
+    spin_unlock(&w->lock);
+    return fired;
+}
+
+/**
+ * @brief timer_now reads mtime
+ *
+ * @return uint64_t mtime, in CLINT_TIMEBASE_FREQ ticks per second
+ */
+uint64_t timer_now() {
+    return _read_mtime();
+}
+
+/**
+ * @brief timer_setup initializes a timer
+ *
+ * @param t timer to initialize
+ * @param func callback, called in interrupt context with interrupts disabled, so it must not block
+ * @param arg parameter passed to func
+ */
+void timer_setup(timer_t *t, void (*func)(void *arg), void *arg) {
+    _node_init(&t->node);
+    t->expires = 0;
+    t->period = 0;
+    t->func = func;
+    t->arg = arg;
+    t->hart = -1;
+}
+
+/**
+ * @brief timer_start starts a timer on current hart, the timer is restarted if pending
+ *
+ * @param t timer to start
+ * @param us microseconds before the timer fires
+ * @param period_us the timer fires again every period_us microseconds, 0 for a one-shot timer
+ */
+void timer_start(timer_t *t, uint32_t us, uint32_t period_us) {
+    timer_cancel(t);
+
+    reg_t flags = irq_save();
+    int id = r_tp();
+    struct wheel *w = &_wheel[id];
+    t->expires = _read_mtime() + (uint64_t)us * TICKS_PER_US;
+    t->period = (uint64_t)period_us * TICKS_PER_US;
+    spin_lock(&w->lock);
+    _wheel_add(w, t, id);
+    spin_unlock(&w->lock);
+    _program(id);
+    irq_restore(flags);
+}
+
+/**
+ * @brief timer_cancel stops a pending timer, it does not wait for a running callback
+ *
+ * @param t timer to stop
+ * @return int 1 if the timer was pending, 0 otherwise
+ */
+int timer_cancel(timer_t *t) {
+    while (1) {
+        int id = t->hart;
+        if (id < 0)
+            return 0;
+
+        struct wheel *w = &_wheel[id];
+        reg_t flags = spin_lock_irqsave(&w->lock);
+        // the timer may have fired, or moved to another hart, before we got the lock
+        int pending = t->hart == id;
+        if (pending) {
+            _node_del(&t->node);
+            t->hart = -1;
+            t->period = 0;
+        }
+        spin_unlock_irqrestore(&w->lock, flags);
+        if (pending)
+            return 1;
+    }
+}
+
+/**
+ * @brief timer_set_quantum sets the length of time slice
+ *
+ * @param us length of time slice in microseconds
+ */
+void timer_set_quantum(uint32_t us) {
+    _quantum = TICKS_PER_US * us;
+}
+
+/**
+ * @brief timer_idle_enter stops the time slice timer of current hart, so that only timer
+ *        events wake it up. Called by the idle task with interrupts disabled.
+ */
+void timer_idle_enter() {
+    int id = r_tp();
+    _tickless[id] = 1;
+    _program(id);
+}
+
+/**
+ * @brief timer_idle_exit starts a new time slice of current hart. Called by the idle task
+ *        with interrupts disabled.
+ */
+void timer_idle_exit() {
+    int id = r_tp();
+    _tickless[id] = 0;
+    _slice_end[id] = _read_mtime() + _quantum;
+    _program(id);
+}
+
+/**
+ * @brief timer_init initializes the timer wheel and starts the time slice timer of current hart
+ */
+void timer_init() {
+    int id = r_tp();
+    struct wheel *w = &_wheel[id];
+    spin_init(&w->lock, "timer");
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        w->bitmap[level][0] = 0;
+        w->bitmap[level][1] = 0;
+        for (int i = 0; i < WHEEL_SLOTS; i++)
+            _node_init(&w->slot[level][i]);
+    }
+    _node_init(&w->expired);
+
+    uint64_t now = _read_mtime();
+    w->now = now >> WHEEL_SHIFT;
+    _slice_end[id] = now + _quantum;
+    _program(id);
+    // enable machine-mode timer interrupt, mstatus.MIE will be set when switching to the first task
+    w_mie(r_mie() | MIE_MTIE);
+}
+
+/**
+ * @brief timer_handler is called when the time slice runs out or a timer is due
+ */
+void timer_handler() {
+    int id = r_tp();
+    uint64_t now = _read_mtime();
+    int resched = _run_timers(id, now) > 0;
+
+    if (!_tickless[id] && now >= _slice_end[id]) {
+        _slice_end[id] = now + _quantum;
+        resched = 1;
+    }
+    _program(id);
+
+    // tasks woken by timers may be more important than the current one
+    if (resched)
+        schedule();
+}
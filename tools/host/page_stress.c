@@ -0,0 +1,441 @@
+/**
+ * @file page_stress.c
+ * @author Jack Wang
+ * @brief Host-native stress test and benchmark of the page allocator (page.c), see 'make host-page'.
+ *        page.c is compiled unchanged with HOST_BUILD against a heap taken from malloc, and this
+ *        driver replays randomized or recorded alloc/free sequences on it, while checking that:
+ *            - blocks are page aligned, inside the heap and never overlap a live block
+ *            - live blocks are not written by the allocator (a tag in every page is verified at free)
+ *            - once everything is freed and all page caches are drained, the pool coalesces back
+ *              into exactly the blocks it had right after page_init()
+ *            - with -z, blocks from page_alloc_zeroed() are all zero, while the zeroed pool is
+ *              refilled in between as idle harts would do
+ *        It reports throughput and fragmentation (largest allocatable block vs free pages) at the
+ *        end of the workload. Harts are played by switching host_hartid, so that the per-hart
+ *        page caches are exercised too, including frees on a hart other than the allocating one.
+ *
+ *        Trace files hold one operation per line ('#' starts a comment):
+ *            a <id> <npages>     allocate npages into slot id
+ *            f <id>              free the block in slot id
+ *            h <hart>            run following operations on hart
+ * @version 0.1
+ * @date 2023-05-20
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "platform.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_ORDER 12
+#define MAX_BLOCKS 4096         // max blocks in the greedy decomposition of the pool
+
+/*
+ * page.c
+ */
+extern void page_init(void);
+extern void *page_alloc(int npages);
+extern void page_free(void *p);
+extern int page_cache_tune(int low, int high, int batch);
+extern void page_cache_drain(void);
+extern void *page_alloc_zeroed(int npages);
+extern int page_zero_refill(void);
+extern void page_zero_drain(void);
+
+/*
+ * symbols page.c takes from the linker script and the rest of the kernel
+ */
+uintptr_t TEXT_START, TEXT_END, DATA_START, DATA_END;
+uintptr_t RODATA_START, RODATA_END, BSS_START, BSS_END;
+uintptr_t HEAP_START;
+uint32_t HEAP_SIZE;
+
+int host_hartid;
+
+struct spinlock;
+
+// the driver is single threaded, harts take turns and never preempt each other
+void spin_init(struct spinlock *lock, const char *name)
+{
+}
+
+void spin_lock(struct spinlock *lock)
+{
+}
+
+void spin_unlock(struct spinlock *lock)
+{
+}
+
+void memzero_page(void *page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+void panic(char *s)
+{
+    fprintf(stderr, "panic: %s\n", s);
+    abort();
+}
+
+/*
+ * driver state
+ */
+struct slot {
+    uint8_t *p;                 // NULL if slot is empty
+    int npages;
+    uint32_t tag;
+};
+
+static struct slot *_slots;
+static int _nslots = 2048;
+static int _harts = 4;
+static int _check = 1;
+static int _zeroed = 0;
+static uint8_t *_heap;
+static uint32_t _heap_pages;
+static int32_t *_owner;         // slot + 1 owning each heap page, 0 if free
+
+static long _allocs, _frees, _failed, _errors;
+static long _live_pages;
+
+static void _error(const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, vl);
+    fprintf(stderr, "\n");
+    va_end(vl);
+    _errors++;
+}
+
+static uint64_t _rand_state = 1;
+
+// xorshift64*, so that a seed gives the same sequence on every host
+static uint32_t _rand()
+{
+    _rand_state ^= _rand_state >> 12;
+    _rand_state ^= _rand_state << 25;
+    _rand_state ^= _rand_state >> 27;
+    return (uint32_t)((_rand_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static double _now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int _do_alloc(int id, int npages)
+{
+    struct slot *s = &_slots[id];
+    if (s->p) {
+        _error("slot %d is already in use", id);
+        return -1;
+    }
+
+    int zeroed = _zeroed && (_rand() & 1);
+    uint8_t *p = zeroed ? page_alloc_zeroed(npages) : page_alloc(npages);
+    _allocs++;
+    if (p == NULL) {
+        _failed++;
+        return 0;
+    }
+    s->p = p;
+    s->npages = npages;
+    s->tag = _rand() | 1;
+    _live_pages += npages;
+    if (!_check)
+        return 0;
+
+    if (p < _heap || p + (size_t)npages * PAGE_SIZE > _heap + (size_t)_heap_pages * PAGE_SIZE ||
+        ((uintptr_t)p & (PAGE_SIZE - 1))) {
+        _error("slot %d got a block out of heap or unaligned: %p", id, (void *)p);
+        s->p = NULL;
+        return -1;
+    }
+    uint32_t first = (p - _heap) >> PAGE_ORDER;
+    if (zeroed) {
+        for (size_t i = 0; i < (size_t)npages * PAGE_SIZE / sizeof(uint32_t); i++) {
+            if (((uint32_t *)p)[i]) {
+                _error("slot %d got a block from page_alloc_zeroed() not zeroed: %p", id, (void *)p);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < npages; i++) {
+        if (_owner[first + i])
+            _error("slot %d overlaps slot %d", id, _owner[first + i] - 1);
+        _owner[first + i] = id + 1;
+        *(uint32_t *)(p + i * PAGE_SIZE) = s->tag + i;
+        *(uint32_t *)(p + (i + 1) * PAGE_SIZE - 4) = ~(s->tag + i);
+    }
+    return 0;
+}
+
+static int _do_free(int id)
+{
+    struct slot *s = &_slots[id];
+    if (!s->p) {
+        _error("slot %d is empty on free", id);
+        return -1;
+    }
+
+    if (_check) {
+        uint32_t first = (s->p - _heap) >> PAGE_ORDER;
+        for (int i = 0; i < s->npages; i++) {
+            uint8_t *page = s->p + i * PAGE_SIZE;
+            if (*(uint32_t *)page != s->tag + i || *(uint32_t *)(page + PAGE_SIZE - 4) != ~(s->tag + i))
+                _error("slot %d was written while live, page %p", id, (void *)page);
+            if (_owner[first + i] != id + 1)
+                _error("slot %d lost ownership of page %p", id, (void *)page);
+            _owner[first + i] = 0;
+        }
+    }
+    page_free(s->p);
+    _frees++;
+    _live_pages -= s->npages;
+    s->p = NULL;
+    return 0;
+}
+
+// block size of the randomized workload, mostly single pages with a long tail
+static int _rand_size()
+{
+    uint32_t r = _rand() % 100;
+    if (r < 60)
+        return 1;
+    if (r < 85)
+        return 2 + _rand() % 7;
+    if (r < 97)
+        return 9 + _rand() % 56;
+    return 65 + _rand() % 448;
+}
+
+static void _run_random(long ops)
+{
+    for (long i = 0; i < ops; i++) {
+        host_hartid = _rand() % _harts;
+        if (_zeroed && _rand() % 4 == 0)
+            page_zero_refill();
+        int id = _rand() % _nslots;
+        if (_slots[id].p)
+            _do_free(id);
+        else
+            _do_alloc(id, _rand_size());
+    }
+}
+
+static int _run_trace(const char *path, long *ops)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[128];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char op;
+        int a = 0, b = 0;
+        lineno++;
+        if (sscanf(line, " %c", &op) != 1 || op == '#')
+            continue;
+        int n = sscanf(line, " %c %d %d", &op, &a, &b);
+        if (op == 'a' && n == 3 && a >= 0 && a < _nslots && b > 0) {
+            _do_alloc(a, b);
+        } else if (op == 'f' && n == 2 && a >= 0 && a < _nslots) {
+            _do_free(a);
+        } else if (op == 'h' && n == 2 && a >= 0 && a < MAXNUM_CPU) {
+            host_hartid = a;
+            continue;
+        } else {
+            fprintf(stderr, "%s:%d: bad line: %s", path, lineno, line);
+            fclose(f);
+            return -1;
+        }
+        (*ops)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * largest block page_alloc() can give right now, by binary search over the block size.
+ * Probes are freed at once, so the pool is left as it was, up to the page caches.
+ */
+static int _largest_block(int limit)
+{
+    int lo = 0, hi = limit;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        void *p = page_alloc(mid);
+        if (p) {
+            page_free(p);
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static void _drain_all()
+{
+    int hart = host_hartid;
+    page_zero_drain();
+    for (host_hartid = 0; host_hartid < MAXNUM_CPU; host_hartid++)
+        page_cache_drain();
+    host_hartid = hart;
+}
+
+/*
+ * split the whole (idle) pool into blocks by taking the largest block until nothing is left,
+ * then free them again. Two decompositions are equal only if the pool has coalesced back.
+ */
+static int _decompose(int *sizes)
+{
+    static void *blocks[MAX_BLOCKS];
+    int n = 0;
+    int size = _heap_pages;
+    _drain_all();
+    while (n < MAX_BLOCKS && (size = _largest_block(size)) > 0) {
+        blocks[n] = page_alloc(size);
+        sizes[n++] = size;
+    }
+    for (int i = 0; i < n; i++)
+        page_free(blocks[i]);
+    _drain_all();
+    return n;
+}
+
+static void _usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n ops] [-s seed] [-m heap_mb] [-l slots] [-H harts] [-c low,high,batch]\n"
+            "          [-t trace] [-x] [-z]\n"
+            "  -n ops     operations of the randomized workload (default 1000000)\n"
+            "  -s seed    random seed (default 1)\n"
+            "  -m heap_mb heap size in MB (default 128, as in the kernel)\n"
+            "  -l slots   max live blocks (default 2048)\n"
+            "  -H harts   harts to spread operations on (default 4, max %d)\n"
+            "  -c l,h,b   page cache watermarks, see page_cache_tune()\n"
+            "  -t trace   replay a trace file instead of the randomized workload\n"
+            "  -x         skip overlap and corruption checks, for throughput\n"
+            "  -z         use page_alloc_zeroed() for half of the allocations and refill the\n"
+            "             zeroed pool in between\n",
+            prog, MAXNUM_CPU);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    long ops = 1000000;
+    uint32_t heap_mb = 128;
+    const char *trace = NULL;
+    int low = -1, high = -1, batch = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:m:l:H:c:t:xz")) != -1) {
+        switch (opt) {
+        case 'n': ops = atol(optarg); break;
+        case 's': _rand_state = strtoull(optarg, NULL, 0) | 1; break;
+        case 'm': heap_mb = atoi(optarg); break;
+        case 'l': _nslots = atoi(optarg); break;
+        case 'H': _harts = atoi(optarg); break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d,%d", &low, &high, &batch) != 3)
+                _usage(argv[0]);
+            break;
+        case 't': trace = optarg; break;
+        case 'x': _check = 0; break;
+        case 'z': _zeroed = 1; break;
+        default: _usage(argv[0]);
+        }
+    }
+    if (heap_mb == 0 || heap_mb > 2048 || _nslots <= 0 || _harts <= 0 || _harts > MAXNUM_CPU)
+        _usage(argv[0]);
+
+    HEAP_SIZE = heap_mb << 20;
+    _heap_pages = HEAP_SIZE >> PAGE_ORDER;
+    _heap = aligned_alloc(PAGE_SIZE, HEAP_SIZE);
+    _owner = calloc(_heap_pages, sizeof(*_owner));
+    _slots = calloc(_nslots, sizeof(*_slots));
+    if (!_heap || !_owner || !_slots) {
+        fprintf(stderr, "out of host memory\n");
+        return 1;
+    }
+    HEAP_START = (uintptr_t)_heap;
+    page_init();
+    if (low >= 0 && page_cache_tune(low, high, batch) < 0) {
+        fprintf(stderr, "invalid page cache watermarks %d,%d,%d\n", low, high, batch);
+        return 2;
+    }
+
+    static int before[MAX_BLOCKS], after[MAX_BLOCKS];
+    int nbefore = _decompose(before);
+    uint32_t total = 0;
+    for (int i = 0; i < nbefore; i++)
+        total += before[i];
+
+#ifdef CONFIG_PAGE_BITMAP
+    const char *backend = "bitmap";
+#else
+    const char *backend = "buddy";
+#endif
+    printf("page_stress: backend=%s pages=%u harts=%d slots=%d checks=%s\n",
+           backend, total, _harts, _nslots, _check ? "on" : "off");
+
+    long done = 0;
+    double t0 = _now();
+    if (trace) {
+        if (_run_trace(trace, &done) < 0)
+            return 2;
+    } else {
+        _run_random(ops);
+        done = ops;
+    }
+    double t = _now() - t0;
+    printf("ops: %ld in %.3f s, %.2f Mops/s (allocs %ld, frees %ld, failed %ld)\n",
+           done, t, t > 0 ? done / t / 1e6 : 0.0, _allocs, _frees, _failed);
+
+    long free_pages = total - _live_pages;
+    int largest = _largest_block(free_pages);
+    printf("fragmentation: live %ld pages, free %ld pages, largest block %d pages, %.1f%%\n",
+           _live_pages, free_pages, largest,
+           free_pages > 0 ? 100.0 * (1.0 - (double)largest / free_pages) : 0.0);
+
+    for (int id = 0; id < _nslots; id++) {
+        if (_slots[id].p) {
+            host_hartid = _rand() % _harts;
+            _do_free(id);
+        }
+    }
+    int nafter = _decompose(after);
+    if (nafter != nbefore || memcmp(before, after, nbefore * sizeof(int))) {
+        _errors++;
+        fprintf(stderr, "FAIL: pool did not coalesce: %d blocks before, %d blocks after\n", nbefore, nafter);
+        for (int i = 0; i < nbefore || i < nafter; i++)
+            fprintf(stderr, "  block %d: %d -> %d pages\n", i, i < nbefore ? before[i] : 0, i < nafter ? after[i] : 0);
+    } else {
+        printf("coalescing: ok, %d block(s), largest %d pages\n", nafter, after[0]);
+    }
+
+    if (_errors) {
+        printf("page_stress: FAILED with %ld error(s)\n", _errors);
+        return 1;
+    }
+    printf("page_stress: PASSED\n");
+    return 0;
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Convert trace records dumped by trace.c into Chrome trace JSON.
+
+Usage: make run TRACE=1 | tee trace.log
+       tools/trace2json.py trace.log > trace.json
+
+Open trace.json in chrome://tracing or https://ui.perfetto.dev. Each hart is a thread:
+the 'switch' events become slices of the task running on it, 'page_alloc'/'page_free'
+drive a counter of pages in use, and every other event is an instant event.
+"""
+import json
+import re
+import sys
+
+LINE = re.compile(r"TRACE (.*)")
+
+TRAP_INTERRUPTS = {3: "software", 7: "timer", 11: "external"}
+
+
+def parse(lines):
+    freq = 10000000
+    names = {}
+    records = []
+    for line in lines:
+        m = LINE.search(line)
+        if not m:
+            continue
+        fields = m.group(1).split()
+        if not fields:
+            continue
+        if fields[0] == "BEGIN":
+            for kv in fields[1:]:
+                key, _, value = kv.partition("=")
+                if key == "freq":
+                    freq = int(value)
+        elif fields[0] == "EVENT" and len(fields) == 3:
+            names[int(fields[1], 16)] = fields[2]
+        elif fields[0] == "END":
+            continue
+        elif len(fields) == 6:
+            try:
+                hart, ts, event, a0, a1, a2 = (int(f, 16) for f in fields)
+            except ValueError:
+                continue  # line garbled by output of another hart
+            records.append((ts, hart, event, a0, a1, a2))
+    records.sort()
+    return freq, names, records
+
+
+def signed(x):
+    return x - (1 << 32) if x & 0x80000000 else x
+
+
+def convert(freq, names, records):
+    events = []
+    if not records:
+        return events
+    start = records[0][0]
+
+    def us(ts):
+        return (ts - start) * 1e6 / freq
+
+    harts = sorted({r[1] for r in records})
+    for hart in harts:
+        events.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": hart,
+                       "args": {"name": "hart %d" % hart}})
+
+    running = {}     # hart -> (name, task id, start ts)
+    blocks = {}      # address -> pages
+    in_use = 0
+    for ts, hart, event, a0, a1, a2 in records:
+        name = names.get(event, "event_%d" % event)
+        if name == "switch":
+            if hart in running:
+                task, tid, since = running[hart]
+                events.append({"ph": "X", "name": task, "pid": 0, "tid": hart,
+                               "ts": us(since), "dur": us(ts) - us(since),
+                               "args": {"task": tid}})
+            task = "idle" if a2 else "task %d" % a1
+            running[hart] = (task, a1, ts)
+        elif name in ("page_alloc", "page_free"):
+            if name == "page_alloc" and a1:
+                blocks[a1] = a0
+                in_use += a0
+            elif name == "page_free":
+                in_use -= blocks.pop(a0, 0)
+            events.append({"ph": "C", "name": "pages in use", "pid": 0, "ts": us(ts),
+                           "args": {"pages": in_use}})
+            args = {"pages": a0, "addr": hex(a1)} if name == "page_alloc" else {"addr": hex(a0)}
+            events.append({"ph": "i", "s": "t", "name": name, "pid": 0, "tid": hart,
+                           "ts": us(ts), "args": args})
+        elif name == "trap":
+            code = a0 & 0x7FFFFFFF
+            if a0 & 0x80000000:
+                label = "irq %s" % TRAP_INTERRUPTS.get(code, code)
+            else:
+                label = "exception %d" % code
+            events.append({"ph": "i", "s": "t", "name": label, "pid": 0, "tid": hart,
+                           "ts": us(ts), "args": {"epc": hex(a1)}})
+        else:
+            events.append({"ph": "i", "s": "t", "name": name, "pid": 0, "tid": hart,
+                           "ts": us(ts), "args": {"a0": signed(a0), "a1": signed(a1), "a2": signed(a2)}})
+
+    # close slices still running at the end of the trace
+    end = records[-1][0]
+    for hart, (task, tid, since) in running.items():
+        events.append({"ph": "X", "name": task, "pid": 0, "tid": hart,
+                       "ts": us(since), "dur": us(end) - us(since), "args": {"task": tid}})
+    return events
+
+
+def main():
+    if len(sys.argv) > 2 or (len(sys.argv) == 2 and sys.argv[1] in ("-h", "--help")):
+        sys.stderr.write(__doc__)
+        return 2
+    src = open(sys.argv[1], errors="replace") if len(sys.argv) == 2 else sys.stdin
+    with src:
+        freq, names, records = parse(src)
+    json.dump({"traceEvents": convert(freq, names, records), "displayTimeUnit": "ns"},
+              sys.stdout, indent=None)
+    sys.stdout.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,175 @@
+/**
+ * @file trace.c
+ * @author Jack Wang
+ * @brief Binary event tracing, built with CONFIG_TRACE (see 'make TRACE=1').
+ *        Each hart appends fixed-size records (mtime, event, 3 arguments) to its own ring,
+ *        which is wait-free and does no formatting, so trace points barely change the timing
+ *        of the code they instrument. Records are formatted only when the rings are dumped
+ *        over UART, by trace_dump() or the drain task, as lines of
+ *
+ *            TRACE <hart> <mtime> <event> <a0> <a1> <a2>
+ *
+ *        all in hex. tools/trace2json.py turns a log holding these lines into Chrome trace JSON.
+ * @version 0.1
+ * @date 2023-05-21
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "os.h"
+
+// records per hart, must be a power of 2
+#define TRACE_RECORDS 1024
+
+// period of the drain task
+#define TRACE_DRAIN_MS 1000
+
+/**
+ * @brief trace record, 32 bytes
+ *
+ *  seq is 0 while the record is being written and index + 1 of the record in the ring once
+ *  written, so that a reader can tell a complete record from a torn or overwritten one.
+ */
+struct trace_rec {
+    uint64_t ts;                // mtime
+    volatile uint32_t seq;
+    uint32_t event;
+    uint32_t arg[3];
+};
+
+/**
+ * @brief trace ring of a hart
+ *
+ *  head is only written by its own hart with interrupts disabled, tail is only touched by
+ *  trace_dump(). Records older than head - TRACE_RECORDS have been overwritten.
+ */
+struct trace_ring {
+    volatile uint32_t head;     // index of the next record to write
+    uint32_t tail;              // index of the next record to dump
+    uint32_t lost;              // records overwritten before being dumped
+    struct trace_rec rec[TRACE_RECORDS];
+};
+
+static struct trace_ring _rings[MAXNUM_CPU];
+static volatile int _dumping = 0;
+
+static const char *_names[TRACE_NR] = {
+    [TRACE_SWITCH] = "switch",
+    [TRACE_TRAP] = "trap",
+    [TRACE_WAKEUP] = "wakeup",
+    [TRACE_STEAL] = "steal",
+    [TRACE_PAGE_ALLOC] = "page_alloc",
+    [TRACE_PAGE_FREE] = "page_free",
+    [TRACE_MARK] = "mark",
+};
+
+/**
+ * @brief trace_emit appends a record to the ring of current hart, overwriting the oldest one
+ *        if the ring is full. Use TRACE() instead, which is compiled out without CONFIG_TRACE.
+ *
+ * @param event event id, see enum trace_event
+ * @param a0 first argument
+ * @param a1 second argument
+ * @param a2 third argument
+ */
+void trace_emit(uint32_t event, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+    // a trap taken in the middle would write the same record
+    reg_t flags = irq_save();
+    struct trace_ring *ring = &_rings[r_tp()];
+    uint32_t index = ring->head;
+    struct trace_rec *rec = &ring->rec[index & (TRACE_RECORDS - 1)];
+
+    rec->seq = 0;
+    __sync_synchronize();
+    rec->ts = timer_now();
+    rec->event = event;
+    rec->arg[0] = a0;
+    rec->arg[1] = a1;
+    rec->arg[2] = a2;
+    __sync_synchronize();
+    rec->seq = index + 1;
+    ring->head = index + 1;
+    irq_restore(flags);
+}
+
+/*
+ * dump records of a hart written since the last dump, returns the number of records dumped
+ */
+static int _dump_ring(int hart)
+{
+    struct trace_ring *ring = &_rings[hart];
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    int n = 0;
+
+    if (head - tail > TRACE_RECORDS) {
+        ring->lost += head - tail - TRACE_RECORDS;
+        tail = head - TRACE_RECORDS;
+    }
+    for (; tail != head; tail++) {
+        struct trace_rec *rec = &ring->rec[tail & (TRACE_RECORDS - 1)];
+        struct trace_rec copy;
+        // the hart may be overwriting the record while we are printing older ones
+        uint32_t seq = rec->seq;
+        __sync_synchronize();
+        copy.ts = rec->ts;
+        copy.event = rec->event;
+        copy.arg[0] = rec->arg[0];
+        copy.arg[1] = rec->arg[1];
+        copy.arg[2] = rec->arg[2];
+        __sync_synchronize();
+        if (seq != tail + 1 || rec->seq != seq) {
+            ring->lost++;
+            continue;
+        }
+        printf("TRACE %x %x%08x %x %x %x %x\n", hart, (uint32_t)(copy.ts >> 32), (uint32_t)copy.ts,
+               copy.event, copy.arg[0], copy.arg[1], copy.arg[2]);
+        n++;
+    }
+    ring->tail = head;
+    return n;
+}
+
+/**
+ * @brief trace_dump prints records written since the last dump over UART. The names of events
+ *        and the frequency of mtime come first, so that the log can be converted without
+ *        knowing the kernel. Returns at once if another hart is dumping.
+ */
+void trace_dump()
+{
+    if (__sync_lock_test_and_set(&_dumping, 1))
+        return;
+
+    printf("TRACE BEGIN freq=%d\n", CLINT_TIMEBASE_FREQ);
+    for (int i = 1; i < TRACE_NR; i++)
+        printf("TRACE EVENT %x %s\n", i, _names[i]);
+    int n = 0;
+    for (int hart = 0; hart < MAXNUM_CPU; hart++)
+        n += _dump_ring(hart);
+    uint32_t lost = 0;
+    for (int hart = 0; hart < MAXNUM_CPU; hart++)
+        lost += _rings[hart].lost;
+    printf("TRACE END records=%d lost=%u\n", n, lost);
+
+    __sync_lock_release(&_dumping);
+}
+
+static void _drain_task(void *param)
+{
+    while (1) {
+        task_sleep_ms(TRACE_DRAIN_MS);
+        trace_dump();
+    }
+}
+
+/**
+ * @brief trace_start creates the drain task, which dumps the rings every TRACE_DRAIN_MS.
+ *        Called by hart 0 at boot when built with CONFIG_TRACE, records are written from
+ *        the very beginning anyway.
+ */
+void trace_start()
+{
+    if (task_create(_drain_task, NULL, PRIO_DEFAULT) < 0)
+        printf("trace: failed to create drain task\n");
+}
@@ -0,0 +1,71 @@
+#include "os.h"
+
+// defined in entry.S
+extern void trap_vector(void);
+extern void timer_handler(void);
+extern void schedule(void);
+
+/**
+ * @brief trap_init sets the trap vector of current hart
+ */
+void trap_init() {
+    w_mtvec((reg_t)trap_vector);
+    // enable machine-mode software interrupt, which is used to ask a hart to reschedule,
+    // and external interrupt, which comes from PLIC
+    w_mie(r_mie() | MIE_MSIE | MIE_MEIE);
+}
+
+/**
+ * @brief external_interrupt_handler dispatches interrupts claimed from PLIC to handlers
+ *        registered by drivers, until none is pending, so that interrupts raised together
+ *        take one trap
+ */
+void external_interrupt_handler() {
+    int irq;
+
+    while ((irq = plic_claim()) != 0) {
+        if (plic_dispatch(irq) < 0)
+            printf("unexpected interrupt irq = %d\n", irq);
+        plic_complete(irq);
+    }
+}
+
+/**
+ * @brief trap_handler handles interrupts and exceptions, called by trap_vector in entry.S
+ * 
+ * @param epc pc when trap happened, i.e., mepc
+ * @param cause cause of the trap, i.e., mcause
+ * @return reg_t pc to return to
+ */
+reg_t trap_handler(reg_t epc, reg_t cause) {
+    reg_t return_pc = epc;
+    reg_t cause_code = cause & MCAUSE_MASK_ECODE;
+
+    TRACE(TRACE_TRAP, cause, epc, 0);
+
+    if (cause & MCAUSE_MASK_INTERRUPT) {
+        // Asynchronous trap - interrupt
+        switch (cause_code) {
+            case 3:
+                // software interrupt asks current hart to reschedule, acknowledge it
+                *(volatile uint32_t *)CLINT_MSIP(r_tp()) = 0;
+                schedule();
+                break;
+            case 7:
+                timer_handler();
+                break;
+            case 11:
+                external_interrupt_handler();
+                break;
+            default:
+                printf("unknown async exception!\n");
+                break;
+        }
+    } else {
+        // Synchronous trap - exception
+        printf("Sync exceptions!, code = %d, epc = 0x%x\n", cause_code, epc);
+        panic("OOPS! What can I do!");
+    }
+
+    return return_pc;
+}
@@ -1,5 +1,4 @@
-#include "types.h"
-#include "platform.h"
+#include "os.h"
 
 /*
  * UART_REG(reg) macro returns the memory address of given registers.
@@ -66,6 +65,63 @@
 #define LSR_RX_READY (1 << 0)
 #define LSR_TX_IDLE  (1 << 5)
 
+/*
+ * INTERRUPT ENABLE REGISTER (IER)
+ * IER BIT 0:
+ * 0 = disable the receiver ready interrupt.
+ * 1 = enable the receiver ready interrupt, which is raised when the receive FIFO reaches
+ *     its trigger level, or holds bytes not read for 4 character times (timeout).
+ * IER BIT 1:
+ * 0 = disable the transmitter holding register empty (THRE) interrupt.
+ * 1 = enable the THRE interrupt.
+ * 
+ * FIFO CONTROL REGISTER (FCR)
+ * FCR BIT 0: 1 = enable the transmit and receive FIFO.
+ * FCR BIT 1: 1 = clear the receive FIFO.
+ * FCR BIT 2: 1 = clear the transmit FIFO.
+ * FCR BIT 6-7: trigger level of the receive FIFO, 00 = 1 byte, 01 = 4 bytes, 10 = 8 bytes, 11 = 14 bytes.
+ */
+#define IER_RX_ENABLE (1 << 0)
+#define IER_TX_ENABLE (1 << 1)
+#define FCR_FIFO_ENABLE (1 << 0)
+#define FCR_FIFO_CLEAR  (3 << 1)
+#define FCR_TRIGGER_8   (2 << 6)
+
+// depth of the transmit FIFO of 16550
+#define UART_FIFO_SIZE 16
+
+/*
+ * Transmit ring buffer
+ *		uart_puts() copies the string to ring buffer, and the THRE interrupt moves
+ *		bytes from ring buffer to the transmit FIFO, up to 16 bytes per interrupt.
+ *		_tx_head is where the next byte is put, _tx_tail is where the next byte is sent,
+ *		both of them run freely and are masked when indexing.
+ */
+#define UART_TX_BUF_SIZE 4096
+static char _tx_buf[UART_TX_BUF_SIZE];
+static volatile uint32_t _tx_head = 0;
+static volatile uint32_t _tx_tail = 0;
+
+/*
+ * Receive ring buffer
+ *		The receiver ready interrupt moves all bytes in the receive FIFO to ring buffer,
+ *		so a burst of input takes one interrupt per 8 bytes (the trigger level), plus one
+ *		timeout interrupt for the rest. Bytes are dropped if ring buffer is full.
+ *		_rx_head is where the next byte is put, _rx_tail is where the next byte is read.
+ */
+#define UART_RX_BUF_SIZE 1024
+static char _rx_buf[UART_RX_BUF_SIZE];
+static uint32_t _rx_head = 0;
+static uint32_t _rx_tail = 0;
+static uint32_t _rx_dropped = 0;
+static int _rx_cr = 0;			// last line read ended with '\r', so a '\n' next is part of it
+static wait_queue_t _rx_wq = WAIT_QUEUE_INIT;
+
+/*
+ * _uart_lock protects both ring buffers and UART registers
+ */
+static spinlock_t _uart_lock;
+
 /**
  * @brief uart_read_reg(reg) macros reads register
  */
@@ -111,30 +167,197 @@ void uart_init(){
 	 */
 	lcr = 0;
 	uart_write_reg(LCR, lcr | (0b00000011 << 0));
+
+	// enable and clear FIFOs, so that we can write 16 bytes at a time, and get an interrupt
+	// every 8 bytes received
+	uart_write_reg(FCR, FCR_FIFO_ENABLE | FCR_FIFO_CLEAR | FCR_TRIGGER_8);
+
+	spin_init(&_uart_lock, "uart");
+
+	// receive by interrupts, transmit interrupts are enabled only when there are bytes to send
+	plic_register(UART0_IRQ, uart_isr, 0);
+	uart_write_reg(IER, IER_RX_ENABLE);
+}
+
+/**
+ * @brief _tx_fill moves bytes from ring buffer to the transmit FIFO if it is empty, and enables
+ *        the THRE interrupt if there are still bytes left. Must be called with interrupts disabled.
+ */
+static void _tx_fill(){
+	if (uart_read_reg(LSR) & LSR_TX_IDLE) {
+		for (int i = 0; i < UART_FIFO_SIZE && _tx_tail != _tx_head; i++) {
+			uart_write_reg(THR, _tx_buf[_tx_tail % UART_TX_BUF_SIZE]);
+			_tx_tail++;
+		}
+	}
+	uart_write_reg(IER, IER_RX_ENABLE | (_tx_tail != _tx_head ? IER_TX_ENABLE : 0));
+}
+
+/**
+ * @brief _tx_put puts a byte to ring buffer, sends bytes synchronously to make room if it is full.
+ *        Must be called with _uart_lock held.
+ */
+static void _tx_put(char ch){
+	while (_tx_head - _tx_tail >= UART_TX_BUF_SIZE) {
+		while ((uart_read_reg(LSR) & LSR_TX_IDLE) == 0);
+		_tx_fill();
+	}
+	_tx_buf[_tx_head % UART_TX_BUF_SIZE] = ch;
+	_tx_head++;
+}
+
+/**
+ * @brief uart_flush sends all bytes in ring buffer by polling, for panic or when interrupts are off
+ */
+void uart_flush(){
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	while (_tx_tail != _tx_head) {
+		while ((uart_read_reg(LSR) & LSR_TX_IDLE) == 0);
+		_tx_fill();
+	}
+	spin_unlock_irqrestore(&_uart_lock, flags);
 }
 
 /**
- * @brief uart_putc puts a byte to THR register (Transmit Holding Register), i.e., sends a char.
+ * @brief uart_putc puts a byte to the transmit ring buffer, i.e., sends a char.
  * 
  * @param ch 
  * @return int 
  */
 int uart_putc(char ch){
-    // polling until THR register is empty, i.e., the previous byte has been sent.
-    // LSR BIT 5:
-    //    1. 0 = transmit holding register is full. 16550 will not accept any data for transmission.
-    //    2. 1 = transmitter hold register (or FIFO) is empty. CPU can load the next character.
-	while ((uart_read_reg(LSR) & LSR_TX_IDLE) == 0);
-	return uart_write_reg(THR, ch);
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	_tx_put(ch);
+	_tx_fill();
+	spin_unlock_irqrestore(&_uart_lock, flags);
+	// nobody will take THRE interrupt if interrupts are off, send it by ourselves
+	if (!flags)
+		uart_flush();
+	return ch;
 }
 
 /**
- * @brief uart_puts puts a string via uart.
+ * @brief uart_puts puts a string via uart, without waiting for it to be sent.
  * 
  * @param s string (null-terminated) to put
  */
 void uart_puts(char *s){
-    while (*s)
-		uart_putc(*s++);
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	while (*s)
+		_tx_put(*s++);
+	_tx_fill();
+	spin_unlock_irqrestore(&_uart_lock, flags);
+	if (!flags)
+		uart_flush();
+}
+
+/**
+ * @brief uart_write puts n bytes via uart, without waiting for them to be sent.
+ *        Unlike uart_puts(), it never flushes, the caller calls uart_flush() if needed.
+ * 
+ * @param s bytes to put
+ * @param n number of bytes
+ */
+void uart_write(const char *s, int n){
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	while (n-- > 0)
+		_tx_put(*s++);
+	_tx_fill();
+	spin_unlock_irqrestore(&_uart_lock, flags);
+}
+
+/**
+ * @brief _rx_drain moves all bytes in the receive FIFO to ring buffer, and wakes up readers.
+ *        Must be called with _uart_lock held.
+ */
+static void _rx_drain(){
+	int n = 0;
+	while (uart_read_reg(LSR) & LSR_RX_READY) {
+		char ch = uart_read_reg(RHR);
+		if (_rx_head - _rx_tail < UART_RX_BUF_SIZE)
+			_rx_buf[_rx_head++ % UART_RX_BUF_SIZE] = ch;
+		else
+			_rx_dropped++;
+		n++;
+	}
+	if (n)
+		wait_wakeup(&_rx_wq);
+}
+
+/**
+ * @brief uart_isr handles UART interrupts, called by external interrupt handler
+ */
+void uart_isr(){
+	spin_lock(&_uart_lock);
+	// reading ISR acknowledges the THRE interrupt, reading RHR until the FIFO is empty
+	// acknowledges the receiver ready interrupt
+	uart_read_reg(ISR);
+	_rx_drain();
+	_tx_fill();
+	spin_unlock(&_uart_lock);
 }
 
+/**
+ * @brief uart_getc receives a byte, sleeps until there is one. Must be called by a task.
+ * 
+ * @return int the byte received
+ */
+int uart_getc(){
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	while (_rx_tail == _rx_head)
+		wait_sleep(&_rx_wq, &_uart_lock);
+	int ch = (uint8_t)_rx_buf[_rx_tail++ % UART_RX_BUF_SIZE];
+	spin_unlock_irqrestore(&_uart_lock, flags);
+	return ch;
+}
+
+/**
+ * @brief uart_read receives up to n bytes, sleeps until there is at least one, and takes
+ *        all bytes received so far. Must be called by a task.
+ * 
+ * @param buf buffer to hold the bytes
+ * @param n size of buf
+ * @return int number of bytes received
+ */
+int uart_read(char *buf, int n){
+	if (n <= 0)
+		return 0;
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	while (_rx_tail == _rx_head)
+		wait_sleep(&_rx_wq, &_uart_lock);
+	int i = 0;
+	while (i < n && _rx_tail != _rx_head)
+		buf[i++] = _rx_buf[_rx_tail++ % UART_RX_BUF_SIZE];
+	spin_unlock_irqrestore(&_uart_lock, flags);
+	return i;
+}
+
+/**
+ * @brief uart_readline receives a line, sleeps until a line ending ('\r' or '\n') arrives or
+ *        buf is full, so that the reader wakes up once per line rather than once per byte.
+ *        The line ending is not stored, and buf is null-terminated. Must be called by a task.
+ * 
+ * @param buf buffer to hold the line
+ * @param n size of buf
+ * @return int length of the line
+ */
+int uart_readline(char *buf, int n){
+	if (n <= 0)
+		return 0;
+	reg_t flags = spin_lock_irqsave(&_uart_lock);
+	int i = 0;
+	while (i < n - 1) {
+		while (_rx_tail == _rx_head)
+			wait_sleep(&_rx_wq, &_uart_lock);
+		char ch = _rx_buf[_rx_tail++ % UART_RX_BUF_SIZE];
+		int cr = _rx_cr;
+		_rx_cr = ch == '\r';
+		if (ch == '\n' && cr && i == 0)
+			continue;
+		if (ch == '\r' || ch == '\n')
+			break;
+		buf[i++] = ch;
+	}
+	buf[i] = '\0';
+	spin_unlock_irqrestore(&_uart_lock, flags);
+	return i;
+}
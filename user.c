@@ -0,0 +1,107 @@
+#include "os.h"
+
+// milliseconds between two messages
+#define DELAY 1000
+
+void user_task0(void *param){
+    printf("Task 0: Created on hart %d!\n", r_tp());
+    while (1) {
+        printf("Task 0: Running on hart %d...\n", r_tp());
+        task_sleep_ms(DELAY);
+    }
+}
+
+void user_task1(void *param){
+    printf("Task 1: Created on hart %d!\n", r_tp());
+    while (1) {
+        printf("Task 1: Running on hart %d...\n", r_tp());
+        task_sleep_ms(DELAY);
+    }
+}
+
+void user_task2(void *param){
+    int n = (int)param;
+    printf("Task 2: Created on hart %d, will yield %d times and exit!\n", r_tp(), n);
+    for (int i = 0; i < n; i++) {
+        printf("Task 2: Running on hart %d...\n", r_tp());
+        task_yield();
+    }
+}
+
+// requests in a batch, each writes or reads 2 pages in 2 buffers
+#define DISK_BATCH 8
+
+void user_task3(void *param){
+    static blk_req_t reqs[DISK_BATCH];
+    blk_req_t *batch[DISK_BATCH];
+    uint8_t *buf = page_alloc(2 * DISK_BATCH);
+
+    if (virtio_blk_capacity() < DISK_BATCH * 2 * PAGE_SIZE / SECTOR_SIZE || buf == NULL) {
+        printf("Task 3: No disk, exit!\n");
+        page_free(buf);
+        return;
+    }
+
+    for (int write = 1; write >= 0; write--) {
+        for (int i = 0; i < 2 * DISK_BATCH * PAGE_SIZE; i++)
+            buf[i] = write ? (uint8_t)(i * 7 + 1) : 0;
+        for (int i = 0; i < DISK_BATCH; i++) {
+            blk_req_t *req = &reqs[i];
+            req->sector = i * 2 * PAGE_SIZE / SECTOR_SIZE;
+            req->write = write;
+            req->nseg = 2;
+            req->seg[0].buf = buf + 2 * i * PAGE_SIZE;
+            req->seg[0].len = PAGE_SIZE;
+            req->seg[1].buf = buf + (2 * i + 1) * PAGE_SIZE;
+            req->seg[1].len = PAGE_SIZE;
+            req->done = NULL;
+            batch[i] = req;
+        }
+        if (virtio_blk_rw(batch, DISK_BATCH) < 0)
+            printf("Task 3: Disk %s failed!\n", write ? "write" : "read");
+    }
+
+    int bad = 0;
+    for (int i = 0; i < 2 * DISK_BATCH * PAGE_SIZE; i++)
+        bad += buf[i] != (uint8_t)(i * 7 + 1);
+    printf("Task 3: Wrote and read back %d KB in batches of %d on hart %d, %s!\n",
+           2 * DISK_BATCH * PAGE_SIZE / 1024, DISK_BATCH, r_tp(), bad ? "mismatch" : "ok");
+    page_free(buf);
+
+    // read blocks through the buffer cache twice, the first pass is read ahead, the second hits
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t blockno = 0; blockno < 2 * DISK_BATCH; blockno++) {
+            buf_t *b = bio_read(blockno);
+            if (b == NULL)
+                continue;
+            if (pass == 1 && blockno == 0) {
+                b->data[0]++;
+                bio_dirty(b);
+            }
+            bio_release(b);
+        }
+    }
+    if (bio_sync() < 0)
+        printf("Task 3: Disk write back failed!\n");
+    bio_stats_print();
+}
+
+// console: sleeps until a line is typed, so it costs nothing while idle
+void user_task4(void *param){
+    char line[128];
+    while (1) {
+        int n = uart_readline(line, sizeof(line));
+        printf("Task 4: Got %d chars on hart %d: %s\n", n, r_tp(), line);
+    }
+}
+
+/**
+ * @brief os_main creates user tasks, called by hart 0. Other harts steal them when idle
+ */
+void os_main(void){
+    task_create(user_task0, NULL, PRIO_DEFAULT);
+    task_create(user_task1, NULL, PRIO_DEFAULT);
+    task_create(user_task2, (void *)3, PRIO_DEFAULT - 1);
+    task_create(user_task3, NULL, PRIO_DEFAULT);
+    task_create(user_task4, NULL, PRIO_DEFAULT);
+}
@@ -0,0 +1,432 @@
+/**
+ * @file virtio.c
+ * @author Jack Wang
+ * @brief VirtIO block device driver over MMIO (legacy and modern), with one split virtqueue.
+ *        Requests are submitted in batches: each request is chained into descriptors
+ *        (header, scatter-gather data buffers, status), all of them are published to the
+ *        available ring at once and the device is notified once per batch. Completions are
+ *        reaped by the interrupt handler, so many requests can be in flight at a time.
+ *
+ *        Reference: Virtual I/O Device (VIRTIO) Version 1.1, https://docs.oasis-open.org/virtio/virtio/v1.1/
+ * @version 0.1
+ * @date 2023-05-22
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "os.h"
+
+/*
+ * VIRTIO_REG(reg) macro returns the memory address of given register of the virtio-mmio device
+ * at VIRTIO0, see 4.2.2 MMIO Device Register Layout
+ */
+#define VIRTIO_REG(reg) ((volatile uint32_t *)(VIRTIO0 + (reg)))
+
+#define MMIO_MAGIC_VALUE        0x000   // 0x74726976, "virt"
+#define MMIO_VERSION            0x004   // 1 is legacy, 2 is modern
+#define MMIO_DEVICE_ID          0x008   // 2 is block device
+#define MMIO_DEVICE_FEATURES    0x010
+#define MMIO_DEVICE_FEATURES_SEL 0x014
+#define MMIO_DRIVER_FEATURES    0x020
+#define MMIO_DRIVER_FEATURES_SEL 0x024
+#define MMIO_GUEST_PAGE_SIZE    0x028   // legacy only
+#define MMIO_QUEUE_SEL          0x030
+#define MMIO_QUEUE_NUM_MAX      0x034
+#define MMIO_QUEUE_NUM          0x038
+#define MMIO_QUEUE_ALIGN        0x03c   // legacy only
+#define MMIO_QUEUE_PFN          0x040   // legacy only
+#define MMIO_QUEUE_READY        0x044   // modern only
+#define MMIO_QUEUE_NOTIFY       0x050
+#define MMIO_INTERRUPT_STATUS   0x060
+#define MMIO_INTERRUPT_ACK      0x064
+#define MMIO_STATUS             0x070
+#define MMIO_QUEUE_DESC_LOW     0x080   // modern only, and so are the following
+#define MMIO_QUEUE_DESC_HIGH    0x084
+#define MMIO_QUEUE_DRIVER_LOW   0x090
+#define MMIO_QUEUE_DRIVER_HIGH  0x094
+#define MMIO_QUEUE_DEVICE_LOW   0x0a0
+#define MMIO_QUEUE_DEVICE_HIGH  0x0a4
+#define MMIO_CONFIG             0x100   // virtio_blk_config, capacity in sectors comes first
+
+#define virtio_read_reg(reg) (*(VIRTIO_REG(reg)))
+#define virtio_write_reg(reg, v) (*(VIRTIO_REG(reg)) = (v))
+
+/*
+ * device status bits, see 2.1 Device Status Field
+ */
+#define STATUS_ACKNOWLEDGE  1
+#define STATUS_DRIVER       2
+#define STATUS_DRIVER_OK    4
+#define STATUS_FEATURES_OK  8
+
+// feature bit 32, i.e., bit 0 of the second 32 bits word, must be accepted by modern drivers
+#define F_VERSION_1_HIGH (1 << 0)
+
+/*
+ * split virtqueue, see 2.6 Split Virtqueues
+ *  - descriptor table: buffers the device reads or writes, chained by next
+ *  - available ring: heads of descriptor chains made available to the device by the driver
+ *  - used ring: heads of descriptor chains the device has done with
+ *
+ *  All of them live in 2 pages: the descriptor table and the available ring in the first one,
+ *  the used ring in the second one, which is also the layout legacy devices require.
+ */
+#define QUEUE_NUM 64
+
+#define VRING_DESC_F_NEXT  1    // buffer continues via next
+#define VRING_DESC_F_WRITE 2    // buffer is written by the device
+#define VRING_USED_F_NO_NOTIFY 1
+
+struct virtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    volatile uint16_t idx;      // where the driver puts the next entry, runs freely
+    uint16_t ring[QUEUE_NUM];
+    uint16_t unused;
+};
+
+struct virtq_used_elem {
+    uint32_t id;                // head of the descriptor chain
+    uint32_t len;
+};
+
+struct virtq_used {
+    volatile uint16_t flags;
+    volatile uint16_t idx;      // where the device puts the next entry, runs freely
+    struct virtq_used_elem ring[QUEUE_NUM];
+    uint16_t avail_event;
+};
+
+/*
+ * request header, see 5.2.6 Device Operation
+ */
+#define VIRTIO_BLK_T_IN  0      // read
+#define VIRTIO_BLK_T_OUT 1      // write
+
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+/*
+ * in-flight request, indexed by the head descriptor of its chain. The header and the status
+ * byte are read and written by the device, so they are kept here rather than on the stack.
+ */
+struct inflight {
+    blk_req_t *req;
+    struct virtio_blk_outhdr hdr;
+    volatile uint8_t status;
+};
+
+static struct virtq_desc *_desc;
+static struct virtq_avail *_avail;
+static struct virtq_used *_used;
+static struct inflight _info[QUEUE_NUM];
+
+static int _free_head;          // free descriptors are chained by next
+static int _nfree;
+static uint16_t _used_idx;      // next used entry to reap
+static uint32_t _capacity;      // in sectors, 0 if there is no device
+
+/*
+ * _lock protects the virtqueue, _wq holds tasks waiting for a request to complete or for
+ * free descriptors
+ */
+static spinlock_t _lock;
+static wait_queue_t _wq = WAIT_QUEUE_INIT;
+
+static void _isr(void);
+
+/**
+ * @brief virtio_blk_init finds the block device and sets up its virtqueue, called once by hart 0
+ */
+void virtio_blk_init()
+{
+    spin_init(&_lock, "virtio");
+
+    uint32_t version = virtio_read_reg(MMIO_VERSION);
+    if (virtio_read_reg(MMIO_MAGIC_VALUE) != 0x74726976 || virtio_read_reg(MMIO_DEVICE_ID) != 2 ||
+        (version != 1 && version != 2)) {
+        printf("virtio: no block device\n");
+        return;
+    }
+
+    // reset, then tell the device we found it and know how to drive it
+    uint32_t status = 0;
+    virtio_write_reg(MMIO_STATUS, status);
+    status |= STATUS_ACKNOWLEDGE;
+    virtio_write_reg(MMIO_STATUS, status);
+    status |= STATUS_DRIVER;
+    virtio_write_reg(MMIO_STATUS, status);
+
+    // request chains are laid out in separate descriptors, no optional feature is needed
+    virtio_write_reg(MMIO_DRIVER_FEATURES_SEL, 0);
+    virtio_write_reg(MMIO_DRIVER_FEATURES, 0);
+    if (version == 2) {
+        virtio_write_reg(MMIO_DRIVER_FEATURES_SEL, 1);
+        virtio_write_reg(MMIO_DRIVER_FEATURES, F_VERSION_1_HIGH);
+        status |= STATUS_FEATURES_OK;
+        virtio_write_reg(MMIO_STATUS, status);
+        if (!(virtio_read_reg(MMIO_STATUS) & STATUS_FEATURES_OK)) {
+            printf("virtio: features not accepted\n");
+            return;
+        }
+    }
+
+    virtio_write_reg(MMIO_QUEUE_SEL, 0);
+    if (virtio_read_reg(MMIO_QUEUE_NUM_MAX) < QUEUE_NUM) {
+        printf("virtio: queue too short\n");
+        return;
+    }
+    uint8_t *ring = page_alloc_zeroed(2);
+    if (ring == NULL) {
+        printf("virtio: out of memory\n");
+        return;
+    }
+    _desc = (struct virtq_desc *)ring;
+    _avail = (struct virtq_avail *)(ring + QUEUE_NUM * sizeof(struct virtq_desc));
+    _used = (struct virtq_used *)(ring + PAGE_SIZE);
+
+    virtio_write_reg(MMIO_QUEUE_NUM, QUEUE_NUM);
+    if (version == 1) {
+        virtio_write_reg(MMIO_GUEST_PAGE_SIZE, PAGE_SIZE);
+        virtio_write_reg(MMIO_QUEUE_ALIGN, PAGE_SIZE);
+        virtio_write_reg(MMIO_QUEUE_PFN, (uint32_t)ring >> PAGE_ORDER);
+    } else {
+        virtio_write_reg(MMIO_QUEUE_DESC_LOW, (uint32_t)_desc);
+        virtio_write_reg(MMIO_QUEUE_DESC_HIGH, 0);
+        virtio_write_reg(MMIO_QUEUE_DRIVER_LOW, (uint32_t)_avail);
+        virtio_write_reg(MMIO_QUEUE_DRIVER_HIGH, 0);
+        virtio_write_reg(MMIO_QUEUE_DEVICE_LOW, (uint32_t)_used);
+        virtio_write_reg(MMIO_QUEUE_DEVICE_HIGH, 0);
+        virtio_write_reg(MMIO_QUEUE_READY, 1);
+    }
+
+    for (int i = 0; i < QUEUE_NUM; i++)
+        _desc[i].next = i + 1;
+    _free_head = 0;
+    _nfree = QUEUE_NUM;
+    _used_idx = 0;
+
+    // capacity is 64 bits, we address at most 2^32 sectors
+    volatile uint32_t *config = VIRTIO_REG(MMIO_CONFIG);
+    _capacity = config[1] ? 0xFFFFFFFF : config[0];
+
+    plic_register(VIRTIO0_IRQ, _isr, 0);
+    status |= STATUS_DRIVER_OK;
+    virtio_write_reg(MMIO_STATUS, status);
+    printf("virtio: block device v%d, %u sectors\n", version, _capacity);
+}
+
+/**
+ * @brief virtio_blk_capacity returns the size of the block device
+ *
+ * @return uint32_t number of sectors, 0 if there is no device
+ */
+uint32_t virtio_blk_capacity()
+{
+    return _capacity;
+}
+
+/*
+ * take n descriptors from the free list and chain them, returns the head.
+ * Must be called with _lock held and at least n free descriptors.
+ */
+static int _desc_alloc(int n)
+{
+    int head = _free_head;
+    int last = head;
+    for (int i = 1; i < n; i++)
+        last = _desc[last].next;
+    _free_head = _desc[last].next;
+    _nfree -= n;
+    return head;
+}
+
+/*
+ * give a descriptor chain back to the free list, must be called with _lock held
+ */
+static void _desc_free(int head)
+{
+    int last = head;
+    int n = 1;
+    while (_desc[last].flags & VRING_DESC_F_NEXT) {
+        last = _desc[last].next;
+        n++;
+    }
+    _desc[last].next = _free_head;
+    _free_head = head;
+    _nfree += n;
+}
+
+/*
+ * make the chains staged in the available ring visible to the device, and notify it
+ * unless it asks not to be notified. Must be called with _lock held.
+ */
+static void _publish(uint16_t idx)
+{
+    if (idx == _avail->idx)
+        return;
+    // the device must see the ring entries before the index
+    __sync_synchronize();
+    _avail->idx = idx;
+    __sync_synchronize();
+    if (!(_used->flags & VRING_USED_F_NO_NOTIFY))
+        virtio_write_reg(MMIO_QUEUE_NOTIFY, 0);
+}
+
+static int _req_valid(blk_req_t *req)
+{
+    if (req->nseg <= 0 || req->nseg > BLK_MAX_SEGS)
+        return 0;
+    uint32_t sectors = 0;
+    for (int i = 0; i < req->nseg; i++) {
+        if (req->seg[i].len == 0 || req->seg[i].len % SECTOR_SIZE)
+            return 0;
+        sectors += req->seg[i].len / SECTOR_SIZE;
+    }
+    return req->sector < _capacity && sectors <= _capacity - req->sector;
+}
+
+/**
+ * @brief virtio_blk_submit queues a batch of requests to the device and returns without
+ *        waiting for them to complete, see virtio_blk_wait(). The device is notified once
+ *        for the whole batch, unless the batch does not fit into the virtqueue, in which case
+ *        it is published in parts, sleeping for in-flight requests to free descriptors.
+ *        Must be called by a task.
+ *
+ *        On completion, status of a request is set, then its done() callback (if any) is
+ *        called in interrupt context, which must not sleep or submit requests.
+ *
+ * @param reqs requests to submit
+ * @param n number of requests
+ * @return int 0 if all requests are submitted, -1 if any request is invalid, in which case
+ *             nothing is submitted
+ */
+int virtio_blk_submit(blk_req_t **reqs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (!_req_valid(reqs[i]))
+            return -1;
+    }
+
+    reg_t flags = spin_lock_irqsave(&_lock);
+    uint16_t idx = _avail->idx;
+    for (int i = 0; i < n; i++) {
+        blk_req_t *req = reqs[i];
+        int ndesc = req->nseg + 2;
+        while (_nfree < ndesc) {
+            _publish(idx);
+            wait_sleep(&_wq, &_lock);
+            // others may have submitted while we were sleeping
+            idx = _avail->idx;
+        }
+
+        int head = _desc_alloc(ndesc);
+        struct inflight *info = &_info[head];
+        info->req = req;
+        info->hdr.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        info->hdr.reserved = 0;
+        info->hdr.sector = req->sector;
+        info->status = 0xff;
+        req->status = BLK_PENDING;
+
+        // header, data buffers, status
+        int d = head;
+        _desc[d].addr = (uint32_t)&info->hdr;
+        _desc[d].len = sizeof(info->hdr);
+        _desc[d].flags = VRING_DESC_F_NEXT;
+        for (int s = 0; s < req->nseg; s++) {
+            d = _desc[d].next;
+            _desc[d].addr = (uint32_t)req->seg[s].buf;
+            _desc[d].len = req->seg[s].len;
+            _desc[d].flags = VRING_DESC_F_NEXT | (req->write ? 0 : VRING_DESC_F_WRITE);
+        }
+        d = _desc[d].next;
+        _desc[d].addr = (uint32_t)&info->status;
+        _desc[d].len = 1;
+        _desc[d].flags = VRING_DESC_F_WRITE;
+
+        _avail->ring[idx % QUEUE_NUM] = head;
+        idx++;
+    }
+    _publish(idx);
+    spin_unlock_irqrestore(&_lock, flags);
+    return 0;
+}
+
+/**
+ * @brief virtio_blk_wait blocks current task until a submitted request completes
+ *
+ * @param req request to wait for
+ * @return int 0 if the request succeeded, -1 if failed
+ */
+int virtio_blk_wait(blk_req_t *req)
+{
+    reg_t flags = spin_lock_irqsave(&_lock);
+    while (req->status == BLK_PENDING)
+        wait_sleep(&_wq, &_lock);
+    spin_unlock_irqrestore(&_lock, flags);
+    return req->status;
+}
+
+/**
+ * @brief virtio_blk_rw submits a batch of requests and waits for all of them
+ *
+ * @param reqs requests to submit
+ * @param n number of requests
+ * @return int 0 if all requests succeeded, -1 otherwise
+ */
+int virtio_blk_rw(blk_req_t **reqs, int n)
+{
+    if (virtio_blk_submit(reqs, n) < 0)
+        return -1;
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (virtio_blk_wait(reqs[i]) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief _isr reaps all completed requests, called on the virtio interrupt
+ */
+static void _isr()
+{
+    blk_req_t *done = NULL;
+
+    spin_lock(&_lock);
+    virtio_write_reg(MMIO_INTERRUPT_ACK, virtio_read_reg(MMIO_INTERRUPT_STATUS) & 0x3);
+    while (_used_idx != _used->idx) {
+        // read the entry after the index
+        __sync_synchronize();
+        int head = _used->ring[_used_idx % QUEUE_NUM].id;
+        struct inflight *info = &_info[head];
+        blk_req_t *req = info->req;
+        req->status = info->status == 0 ? 0 : -1;
+        info->req = NULL;
+        _desc_free(head);
+        _used_idx++;
+        if (req->done) {
+            req->next = done;
+            done = req;
+        }
+    }
+    wait_wakeup(&_wq);
+    spin_unlock(&_lock);
+
+    // callbacks may take their own locks, so they are called without ours
+    while (done) {
+        blk_req_t *req = done;
+        done = req->next;
+        req->done(req);
+    }
+}